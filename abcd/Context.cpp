@@ -6,17 +6,40 @@
  */
 
 #include "Context.hpp"
+#include "WalletPaths.hpp"
 #include "bitcoin/cache/BlockCache.hpp"
+#include "bitcoin/cache/Cache.hpp"
 #include "exchange/ExchangeCache.hpp"
 #include "bitcoin/cache/ServerCache.hpp"
+#include "bitcoin/cache/TxStore.hpp"
+#include "bitcoin/network/ConnectionPool.hpp"
+#include "util/FileIO.hpp"
 
 namespace abcd {
 
 std::unique_ptr<Context> gContext;
 
+/**
+ * Lists the transactions that the wallet caches on disk refer to.
+ * Wallets without a binary cache have nothing in the store yet.
+ */
+static Status
+cacheReferences(TxStore::Txids &result, RootPaths &paths)
+{
+    for (const auto &id: paths.walletList())
+    {
+        const auto path = paths.walletDir(id).cachePath();
+        if (fileExists(path))
+            ABC_CHECK(Cache::txidsLoad(result, path));
+    }
+    return Status();
+}
+
 Context::~Context()
 {
+    delete &connectionPool; // Uses the caches, so it goes first
     delete &blockCache;
+    delete &txStore;
     delete &exchangeCache;
 }
 
@@ -28,9 +51,15 @@ Context::Context(const std::string &rootDir, const std::string &certPath,
     accountType_(accountType),
     hiddenBitsKey_(hiddenBitsKey),
     paths(rootDir, certPath),
-    blockCache(*new BlockCache(paths.blockCachePath())),
+    blockCache(*new BlockCache(paths.blockCachePath(),
+                               paths.blockHeadersPath())),
+    txStore(*new TxStore(paths.txStorePath(), [this](TxStore::Txids &result)
+    {
+        return cacheReferences(result, paths);
+    })),
     exchangeCache(*new ExchangeCache(paths.exchangeCachePath())),
-    serverCache(*new ServerCache(paths.serverScoresPath()))
+    serverCache(*new ServerCache(paths.serverScoresPath())),
+    connectionPool(*new ConnectionPool(blockCache, serverCache))
 {
     blockCache.load().log(); // Failure is fine
 }
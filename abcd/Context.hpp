@@ -14,8 +14,10 @@
 namespace abcd {
 
 class BlockCache;
+class ConnectionPool;
 class ExchangeCache;
 class ServerCache;
+class TxStore;
 
 /**
  * An object holding app-wide information, such as paths.
@@ -41,8 +43,10 @@ private:
 public:
     RootPaths paths;
     BlockCache &blockCache;
+    TxStore &txStore;
     ExchangeCache &exchangeCache;
     ServerCache &serverCache;
+    ConnectionPool &connectionPool;
 };
 
 /**
@@ -146,5 +146,29 @@ RootPaths::walletDir(const std::string &id)
     return WalletPaths(walletsDir() + id + '/');
 }
 
+std::list<std::string>
+RootPaths::walletList()
+{
+    std::list<std::string> out;
+
+    std::string wallets = walletsDir();
+    DIR *dir = opendir(wallets.c_str());
+    if (!dir)
+        return out;
+
+    struct dirent *de;
+    while (nullptr != (de = readdir(dir)))
+    {
+        // Skip hidden files:
+        if (de->d_name[0] == '.')
+            continue;
+
+        out.push_back(de->d_name);
+    }
+
+    closedir(dir);
+    return out;
+}
+
 
 } // namespace abcd
@@ -54,9 +54,17 @@ public:
     WalletPaths
     walletDir(const std::string &id);
 
+    /**
+     * Lists the ids of the wallets on the device.
+     */
+    std::list<std::string>
+    walletList();
+
     // Individual files:
     const std::string &certPath() const { return certPath_; }
     std::string blockCachePath() const { return dir_ + "Blocks.json"; }
+    std::string blockHeadersPath() const { return dir_ + "Headers.bin"; }
+    std::string txStorePath() const { return dir_ + "Transactions.bin"; }
     std::string exchangeCachePath() const { return dir_ + "Exchange.json"; }
     std::string feeCachePath() const { return dir_ + "Fees.json"; }
     std::string twentyOneFeeCachePath() const { return dir_ + "TwentyOneFees.json"; }
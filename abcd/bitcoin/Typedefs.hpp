@@ -14,14 +14,19 @@
 
 #include "../util/Status.hpp"
 #include <functional>
+#include <iterator>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace libbitcoin {
 
 struct block_header_type;
 struct transaction_type;
 
+template <typename Iterator, bool SafeCheckLast> class deserializer;
+template <typename Iterator> class serializer;
+
 } // namespace libbitcoin
 
 namespace abcd {
@@ -31,6 +36,17 @@ typedef std::set<std::string> TxidSet;
 
 typedef std::function<void(Status)> StatusCallback;
 
+/**
+ * Reads fields out of a binary cache file.
+ */
+typedef libbitcoin::deserializer<const uint8_t *, true> CacheReader;
+
+/**
+ * Appends fields to a binary cache file.
+ */
+typedef libbitcoin::serializer<std::back_insert_iterator<std::vector<uint8_t>>>
+        CacheWriter;
+
 } // namespace abcd
 
 #endif
@@ -17,6 +17,19 @@
 
 namespace abcd {
 
+/**
+ * Hashes a `bc::hash_digest` for use as an unordered container key.
+ * The digest is already uniformly distributed, so a prefix is enough.
+ */
+struct HashDigestHash
+{
+    std::size_t
+    operator()(const bc::hash_digest &hash) const
+    {
+        return bc::from_little_endian_unsafe<std::size_t>(hash.begin());
+    }
+};
+
 /**
  * Calculates the non-malleable id for a transaction.
  */
@@ -10,13 +10,18 @@
 
 #include "network/TxUpdater.hpp"
 #include "../wallet/Wallet.hpp"
-#include <zmq.hpp>
+#include <condition_variable>
+#include <functional>
 #include <mutex>
 
 namespace abcd {
 
+class ConnectionPool;
+
 /**
  * Provides threading support for the TxUpdater object.
+ * The real work happens on the shared ConnectionPool thread,
+ * so this thread just keeps the wallet in the pool while it runs.
  */
 class Watcher
 {
@@ -29,6 +34,18 @@ public:
     void connect();
     void sendTx(StatusCallback status, DataSlice tx);
 
+    /**
+     * Runs a task on the pool thread, outside of any cache locks.
+     * The task is dropped if the watcher stops first.
+     */
+    void post(const std::function<void ()> &task);
+
+    /**
+     * Saves the wallet cache from the pool thread,
+     * once it has let go of the pool and cache locks.
+     */
+    void save();
+
     // - Thread implementation: --------
 
     /**
@@ -48,13 +65,12 @@ public:
     Watcher &operator=(const Watcher &copy) = delete;
 
 private:
-    // Socket for talking to the thread:
-    std::mutex socket_mutex_;
-    std::string socket_name_;
-    zmq::socket_t socket_;
+    ConnectionPool &pool_;
 
-    // Everything below this point is only touched by the thread:
-    bool command(uint8_t *data, size_t size);
+    // Tells the thread to quit:
+    std::mutex mutex_;
+    std::condition_variable quitCondition_;
+    bool quit_ = false;
 
     // This needs to be constructed last, since it uses everything else:
     TxUpdater txu_;
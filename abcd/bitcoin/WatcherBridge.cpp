@@ -138,7 +138,10 @@ bridgeOnComplete(std::shared_ptr<WatcherInfo> watcherInfo,
         auto sweep = *i;
         watcherInfo->sweeping.erase(i);
 
+        // We are on the pool thread inside the address cache lock,
+        // so let the pool save the cache once it has let go of both:
         sweepOnComplete(wallet, sweep.first, sweep.second, fCallback, pData);
+        watcherInfo->watcher.save();
     }
 
     // Send the AddressCheckDone callback if its time:
@@ -147,6 +150,16 @@ bridgeOnComplete(std::shared_ptr<WatcherInfo> watcherInfo,
     {
         ABC_DebugLog("AddressCheckDone callback: wallet %s",
                      wallet.id().c_str());
+
+        // The gap limit has been checked, so drop the unused lookahead.
+        // We are inside the address cache lock, and the address database
+        // takes its own lock first, so do this once the lock is free:
+        auto &addresses = wallet.addresses;
+        watcherInfo->watcher.post([&addresses]()
+        {
+            addresses.discoveryStop().log();
+        });
+
         tABC_AsyncBitCoinInfo info;
         info.pData = pData;
         info.eventType = ABC_AsyncEventType_AddressCheckDone;
@@ -155,7 +168,7 @@ bridgeOnComplete(std::shared_ptr<WatcherInfo> watcherInfo,
         info.szTxID = nullptr;
         info.sweepSatoshi = 0;
         wallet.cache.addressCheckDoneSet();
-        wallet.cache.save();
+        watcherInfo->watcher.save();
         fCallback(&info);
     }
 }
@@ -7,15 +7,26 @@
 
 #include "AddressCache.hpp"
 #include "TxCache.hpp"
+#include "../../crypto/Encoding.hpp"
 #include "../../json/JsonArray.hpp"
 #include "../../json/JsonObject.hpp"
 #include "../../util/Debug.hpp"
+#include <tuple>
 
 namespace abcd {
 
 constexpr auto periodDefault = 20;
 constexpr auto periodPriority = 4;
 
+// Quiet addresses double their period after each uneventful check,
+// up to about 20 minutes:
+constexpr unsigned backoffMaximum = 6;
+
+// Priority polling is for the addresses on screen,
+// so it shouldn't outlive the user's attention:
+constexpr time_t priorityTimeout = 10 * 60;
+constexpr size_t priorityMaximum = 8;
+
 struct CacheJson:
     public JsonObject
 {
@@ -61,10 +72,21 @@ AddressCache::clear()
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
 
-    priorityAddress_ = "";
+    priorityAddresses_.clear();
+    schedule_.clear();
+    pending_.clear();
+    txidAddresses_.clear();
+    waiting_.clear();
+    blocked_.clear();
+    unchecked_.clear();
     for (auto &row: rows_)
+    {
         row.second = AddressRow();
+        reschedule(row.first, row.second);
+        recheck_.insert(row.first);
+    }
     knownTxids_.clear();
+    journal_.clear();
 }
 
 Status
@@ -101,7 +123,7 @@ AddressCache::load(JsonObject &json)
             if (addressJson.stratumHashOk())
                 row.stratumHash = addressJson.stratumHash();
 
-            rows_[address] = row;
+            rowInsert(address, row);
         }
     }
     updateInternal();
@@ -110,34 +132,65 @@ AddressCache::load(JsonObject &json)
 }
 
 Status
-AddressCache::save(JsonObject &json)
+AddressCache::load(CacheReader &serial)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
-    CacheJson cacheJson(json);
+    const auto now = time(nullptr);
 
-    JsonArray addressesJson;
+    const auto size = serial.read_variable_uint();
+    for (uint64_t i = 0; i < size; ++i)
+        rowLoad(serial, now);
+    updateInternal();
+
+    return Status();
+}
+
+void
+AddressCache::save(CacheWriter &serial)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    size_t size = 0;
     for (const auto &row: rows_)
-    {
-        if (row.second.sweep)
-            continue;
+        if (row.second.saved())
+            ++size;
+
+    serial.write_variable_uint(size);
+    for (const auto &row: rows_)
+        if (row.second.saved())
+            rowSave(serial, row.first, row.second);
+
+    // Everything is in the snapshot now:
+    journal_.clear();
+}
+
+bool
+AddressCache::journalSave(CacheWriter &serial)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
 
-        JsonArray txidsJson;
-        for (const auto &txid: row.second.txids)
-            ABC_CHECK(txidsJson.append(json_string(txid.c_str())));
-
-        AddressJson address;
-        ABC_CHECK(address.addressSet(row.first));
-        if (row.second.dirty)
-            ABC_CHECK(address.dirtySet(row.second.dirty));
-        ABC_CHECK(address.txidsSet(txidsJson));
-        ABC_CHECK(address.lastCheckSet(row.second.lastCheck));
-        if (!row.second.stratumHash.empty())
-            ABC_CHECK(address.stratumHashSet(row.second.stratumHash));
-        ABC_CHECK(addressesJson.append(address));
+    std::list<decltype(rows_)::const_iterator> changed;
+    for (const auto &address: journal_)
+    {
+        auto i = rows_.find(address);
+        if (rows_.end() != i && i->second.saved())
+            changed.push_back(i);
     }
-    cacheJson.addressesSet(addressesJson);
 
-    return Status();
+    serial.write_variable_uint(changed.size());
+    for (const auto &i: changed)
+        rowSave(serial, i->first, i->second);
+
+    const bool out = !journal_.empty();
+    journal_.clear();
+    return out;
+}
+
+Status
+AddressCache::journalLoad(CacheReader &serial)
+{
+    // The row format is the same as the snapshot:
+    return load(serial);
 }
 
 std::pair<size_t, size_t>
@@ -160,19 +213,21 @@ AddressCache::statuses(time_t &sleep) const
     std::list<AddressStatus> out;
 
     time_t now = time(nullptr);
-    time_t nextCheck = now;
-    for (auto &row: rows_)
+
+    // Only visit addresses that are due or have pending work:
+    std::set<std::string> addresses = pending_;
+    auto next = schedule_.begin();
+    for (; schedule_.end() != next && next->first <= now; ++next)
+        addresses.insert(next->second);
+
+    for (const auto &address: addresses)
     {
-        const auto s = status(row.first, row.second, now);
+        const auto s = status(address, rows_.find(address)->second, now);
         if (s.dirty || s.needsCheck || s.missingTxids.size())
             out.push_back(std::move(s));
-
-        if (now < s.nextCheck
-                && (s.nextCheck < nextCheck || now == nextCheck))
-            nextCheck = s.nextCheck;
     }
 
-    sleep = nextCheck - now;
+    sleep = schedule_.end() != next ? next->first - now : 0;
     out.sort();
     return out;
 }
@@ -193,36 +248,125 @@ AddressCache::insert(const std::string &address, bool sweep)
     {
         auto &row = rows_[address];
         row.sweep = sweep;
+        reschedule(address, row);
+        journal_.insert(address);
 
         if (wakeupCallback_)
             wakeupCallback_();
     }
     else
     {
+        auto &row = rows_[address];
         if (sweep)
         {
             // We are re-sweeping a key, so re-arm the callback:
-            rows_[address].knownComplete = false;
+            row.knownComplete = false;
+            recheck_.insert(address);
             updateInternal();
         }
+        else if (row.lookahead)
+        {
+            // The address is ours now, so it goes on disk:
+            row.lookahead = false;
+            journal_.insert(address);
+        }
+    }
+}
+
+void
+AddressCache::insertLookahead(const std::string &address)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    if (rows_.end() == rows_.find(address))
+    {
+        auto &row = rows_[address];
+        row.lookahead = true;
+        reschedule(address, row);
+
+        if (wakeupCallback_)
+            wakeupCallback_();
     }
 }
 
+bool
+AddressCache::remove(const std::string &address)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    auto i = rows_.find(address);
+    if (rows_.end() == i)
+        return true;
+    if (!i->second.lookahead || !i->second.txids.empty())
+        return false;
+
+    // Without any txids, the row has nothing in `txidAddresses_`:
+    schedule_.erase(std::make_pair(i->second.due, address));
+    pending_.erase(address);
+    recheck_.erase(address);
+    journal_.erase(address);
+    priorityAddresses_.erase(address);
+    rows_.erase(i);
+    return true;
+}
+
 void
 AddressCache::prioritize(const std::string &address)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
+    const auto now = time(nullptr);
 
-    priorityAddress_ = address;
+    // Drop expired addresses, and make room for the new one:
+    std::set<std::string> changed;
+    auto i = priorityAddresses_.begin();
+    while (priorityAddresses_.end() != i)
+    {
+        if (address.empty() || i->second <= now)
+        {
+            changed.insert(i->first);
+            i = priorityAddresses_.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+    if (!address.empty())
+    {
+        if (!priorityAddresses_.count(address) &&
+                priorityMaximum <= priorityAddresses_.size())
+        {
+            auto oldest = priorityAddresses_.begin();
+            for (auto j = oldest; priorityAddresses_.end() != j; ++j)
+                if (j->second < oldest->second)
+                    oldest = j;
+            changed.insert(oldest->first);
+            priorityAddresses_.erase(oldest);
+        }
+        priorityAddresses_[address] = now + priorityTimeout;
+        changed.insert(address);
+    }
+
+    // All these addresses change their check period:
+    for (const auto &key: changed)
+    {
+        auto row = rows_.find(key);
+        if (rows_.end() != row)
+        {
+            row->second.backoff = 0;
+            reschedule(row->first, row->second);
+        }
+    }
 
     if (wakeupCallback_)
         wakeupCallback_();
 }
 
 void
-AddressCache::update()
+AddressCache::updateTx(const std::string &txid)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
+    wake(txid);
     updateInternal();
 }
 
@@ -230,7 +374,12 @@ void
 AddressCache::update(const std::string &address, const TxidSet &txids)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
-    auto &row = rows_[address];
+
+    // The address might have gone away while the request was out:
+    auto i = rows_.find(address);
+    if (rows_.end() == i)
+        return;
+    auto &row = i->second;
 
     // Look for dropped txids:
     TxidSet drops;
@@ -245,18 +394,35 @@ AddressCache::update(const std::string &address, const TxidSet &txids)
 
     // Remove the dropped txids from all addresses:
     for (const auto &txid: drops)
-        for (auto &row: rows_)
-            row.second.txids.erase(txid);
+    {
+        auto j = txidAddresses_.find(txid);
+        if (txidAddresses_.end() == j)
+            continue;
+
+        for (const auto &address: j->second)
+        {
+            auto k = rows_.find(address);
+            if (rows_.end() != k)
+                k->second.txids.erase(txid);
+            journal_.insert(address);
+            recheck_.insert(address);
+        }
+        txidAddresses_.erase(j);
+        blocked_.erase(txid);
+    }
 
     // Look for new txids:
     for (const auto &txid: txids)
         if (!row.txids.count(txid))
-            row.insertTxid(txid);
+            txidInsert(address, row, txid);
 
     // Update timestamp:
     row.dirty = false;
     row.lastCheck = time(nullptr);
     row.checkedOnce = true;
+    reschedule(address, row);
+    recheck_.insert(address);
+    journal_.insert(address);
 
     // Fire callbacks:
     updateInternal();
@@ -271,8 +437,13 @@ AddressCache::updateSpend(TxInfo &info)
     {
         const auto i = rows_.find(io.address);
         if (rows_.end() != i)
-            i->second.insertTxid(info.txid);
+        {
+            txidInsert(i->first, i->second, info.txid);
+            reschedule(i->first, i->second);
+            journal_.insert(io.address);
+        }
     }
+    wake(info.txid);
 
     // Fire callbacks:
     updateInternal();
@@ -282,10 +453,33 @@ void
 AddressCache::updateSubscribe(const std::string &address)
 {
     std::lock_guard<std::recursive_mutex> lock(mutex_);
-    auto &row = rows_[address];
+
+    // The address might have gone away while the request was out:
+    auto i = rows_.find(address);
+    if (rows_.end() == i)
+        return;
+    auto &row = i->second;
 
     if (row.checkedOnce)
+    {
         row.lastCheck = time(nullptr);
+        journal_.insert(address);
+        if (!row.dirty)
+        {
+            // Priority addresses keep the base period for when it ends:
+            const auto priority = priorityAddresses_.find(address);
+            if (priorityAddresses_.end() == priority)
+            {
+                backoff(row);
+            }
+            else if (priority->second <= row.lastCheck)
+            {
+                priorityAddresses_.erase(priority);
+                row.backoff = 0;
+            }
+        }
+    }
+    reschedule(address, row);
 }
 
 std::string
@@ -302,6 +496,29 @@ AddressCache::getStratumHash(const std::string &address)
 }
 
 
+std::string
+AddressCache::localHash(const AddressRow &row) const
+{
+    if (row.txids.empty())
+        return "";
+
+    // Sort by height, with unconfirmed transactions last:
+    const auto heights = txCache_.heights(row.txids);
+    std::set<std::tuple<bool, size_t, std::string>> sorted;
+    for (const auto &txid: row.txids)
+    {
+        const auto i = heights.find(txid);
+        const size_t height = heights.end() == i ? 0 : i->second;
+        sorted.insert(std::make_tuple(!height, height, txid));
+    }
+
+    std::string status;
+    for (const auto &i: sorted)
+        status += std::get<2>(i) + ":" + std::to_string(std::get<1>(i)) + ":";
+    return base16Encode(bc::sha256_hash(
+                            bc::data_chunk(status.begin(), status.end())));
+}
+
 bool
 AddressCache::updateStratumHash(const std::string &address,
                                 const std::string &hash)
@@ -313,14 +530,57 @@ AddressCache::updateStratumHash(const std::string &address,
         return true;
     auto &row = i->second;
 
-    row.dirty |= (row.stratumHash.empty() || hash != row.stratumHash);
+    const auto old = std::make_pair(row.dirty, row.stratumHash);
+    if (row.stratumHash.empty() || hash != row.stratumHash)
+    {
+        // We might already have the new state from another address:
+        if (hash.empty() || row.dirty || !row.checkedOnce ||
+                hash != localHash(row))
+            row.dirty = true;
+
+        // Something is happening, so watch closely:
+        row.backoff = 0;
+    }
     if (!hash.empty())
         row.stratumHash = hash;
+    if (old != std::make_pair(row.dirty, row.stratumHash))
+    {
+        reschedule(address, row);
+        journal_.insert(address);
+    }
     if (!row.dirty)
         row.checkedOnce = true;
+
+    // A clean reply can finish an address that loaded from disk:
+    if (row.checkedOnce)
+    {
+        recheck_.insert(address);
+        updateInternal();
+    }
     return row.dirty;
 }
 
+void
+AddressCache::updateHeight()
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    // An address with several pending transactions only needs one mark:
+    std::set<std::string> addresses;
+    for (const auto &txid: txCache_.unconfirmed())
+    {
+        const auto i = txidAddresses_.find(txid);
+        if (txidAddresses_.end() != i)
+            addresses.insert(i->second.begin(), i->second.end());
+    }
+
+    for (const auto &address: addresses)
+    {
+        ABC_DebugLog("Marking %s dirty (tx height check)", address.c_str());
+        updateStratumHash(address);
+    }
+}
+
 void
 AddressCache::wakeupCallbackSet(const Callback &callback)
 {
@@ -345,13 +605,70 @@ AddressCache::onCompleteSet(const CompleteCallback &onComplete)
 time_t
 AddressCache::nextCheck(const std::string &address, const AddressRow &row) const
 {
-    time_t period = periodDefault;
-    if (priorityAddress_ == address)
+    time_t period = periodDefault << row.backoff;
+
+    const auto i = priorityAddresses_.find(address);
+    if (priorityAddresses_.end() != i && row.lastCheck < i->second)
         period = periodPriority;
 
     return row.lastCheck + period;
 }
 
+void
+AddressCache::backoff(AddressRow &row)
+{
+    if (backoffMaximum <= row.backoff)
+        return;
+
+    // Pending transactions could confirm or double-spend at any moment:
+    for (const auto &height: txCache_.heights(row.txids))
+        if (!height.second)
+            return;
+
+    ++row.backoff;
+}
+
+void
+AddressCache::rowLoad(CacheReader &serial, time_t now)
+{
+    const auto address = serial.read_string();
+    AddressRow row;
+
+    const auto txidsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < txidsSize; ++i)
+        row.insertTxid(bc::encode_hash(serial.read_hash()));
+
+    row.dirty = serial.read_byte();
+    row.lastCheck = serial.read_8_bytes();
+    if (now < nextCheck(address, row))
+        row.checkedOnce = true;
+    row.stratumHash = serial.read_string();
+
+    rowInsert(address, row);
+}
+
+void
+AddressCache::rowSave(CacheWriter &serial, const std::string &address,
+                      const AddressRow &row) const
+{
+    std::vector<bc::hash_digest> txids;
+    txids.reserve(row.txids.size());
+    for (const auto &txid: row.txids)
+    {
+        bc::hash_digest hash;
+        if (bc::decode_hash(hash, txid))
+            txids.push_back(hash);
+    }
+
+    serial.write_string(address);
+    serial.write_variable_uint(txids.size());
+    for (const auto &txid: txids)
+        serial.write_hash(txid);
+    serial.write_byte(row.dirty);
+    serial.write_8_bytes(row.lastCheck);
+    serial.write_string(row.stratumHash);
+}
+
 AddressStatus
 AddressCache::status(const std::string &address, const AddressRow &row,
                      time_t now) const
@@ -368,48 +685,127 @@ AddressCache::status(const std::string &address, const AddressRow &row,
     return out;
 }
 
+void
+AddressCache::reschedule(const std::string &address, AddressRow &row)
+{
+    schedule_.erase(std::make_pair(row.due, address));
+    row.due = nextCheck(address, row);
+    schedule_.emplace(row.due, address);
+
+    if (row.dirty || !row.complete)
+        pending_.insert(address);
+    else
+        pending_.erase(address);
+}
+
+void
+AddressCache::txidInsert(const std::string &address, AddressRow &row,
+                         const std::string &txid)
+{
+    row.insertTxid(txid);
+    txidAddresses_[txid].insert(address);
+    unchecked_.insert(txid);
+    recheck_.insert(address);
+}
+
+void
+AddressCache::wake(const std::string &txid)
+{
+    auto i = waiting_.find(txid);
+    if (waiting_.end() == i)
+        return;
+
+    unchecked_.insert(i->second.begin(), i->second.end());
+    waiting_.erase(i);
+}
+
+void
+AddressCache::rowInsert(const std::string &address, const AddressRow &row)
+{
+    auto &slot = rows_[address];
+    schedule_.erase(std::make_pair(slot.due, address));
+    for (const auto &txid: slot.txids)
+    {
+        auto i = txidAddresses_.find(txid);
+        i->second.erase(address);
+        if (i->second.empty())
+            txidAddresses_.erase(i);
+    }
+
+    slot = row;
+    for (const auto &txid: slot.txids)
+    {
+        txidAddresses_[txid].insert(address);
+        unchecked_.insert(txid);
+    }
+    recheck_.insert(address);
+    reschedule(address, slot);
+}
+
 void
 AddressCache::updateInternal()
 {
-    // Check for newly-completed transactions:
-    for (auto &row: rows_)
+    // Let the GUI see this batch of changes before we tell it about them:
+    txCache_.snapshotPublish();
+
+    // Check transactions that might have arrived:
+    while (!unchecked_.empty())
     {
-        // Skip rows that are already complete:
-        if (row.second.complete)
+        const auto txid = *unchecked_.begin();
+        unchecked_.erase(unchecked_.begin());
+
+        // Skip transactions we already know about or no longer list:
+        const auto addresses = txidAddresses_.find(txid);
+        if (txidAddresses_.end() == addresses || knownTxids_.count(txid))
             continue;
 
-        row.second.complete = true;
-        for (const auto &txid: row.second.txids)
+        const auto missing = txCache_.missingTxids(TxidSet{txid});
+        if (!missing.empty())
         {
-            // Skip transactions we already know about:
-            if (knownTxids_.count(txid))
-                continue;
+            blocked_.insert(txid);
+            for (const auto &need: missing)
+                waiting_[need].insert(txid);
+            continue;
+        }
+        blocked_.erase(txid);
 
-            if (txCache_.missing(txid))
-            {
-                row.second.complete = false;
-                continue;
-            }
+        bool sweep = true;
+        for (const auto &address: addresses->second)
+        {
+            recheck_.insert(address);
+            sweep &= rows_[address].sweep;
+        }
 
-            // Don't notify the GUI about sweep transactions:
-            if (!row.second.sweep)
-            {
-                knownTxids_.insert(txid);
-                if (onTx_)
-                    onTx_(txid);
-            }
+        // Don't notify the GUI about sweep transactions:
+        if (!sweep)
+        {
+            knownTxids_.insert(txid);
+            if (onTx_)
+                onTx_(txid);
         }
     }
 
     // Check for newly-completed addresses:
-    for (auto &row: rows_)
+    std::set<std::string> recheck;
+    recheck.swap(recheck_);
+    for (const auto &address: recheck)
     {
-        if (row.second.checkedOnce && row.second.complete
-                && !row.second.knownComplete)
+        auto i = rows_.find(address);
+        if (rows_.end() == i)
+            continue;
+        auto &row = i->second;
+
+        row.complete = true;
+        for (const auto &txid: row.txids)
+            if (blocked_.count(txid))
+                row.complete = false;
+        reschedule(address, row);
+
+        if (row.checkedOnce && row.complete && !row.knownComplete)
         {
-            row.second.knownComplete = true;
+            row.knownComplete = true;
             if (onComplete_)
-                onComplete_(row.first);
+                onComplete_(address);
         }
     }
 }
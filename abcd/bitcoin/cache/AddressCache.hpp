@@ -52,10 +52,10 @@ operator <(const AddressStatus &a, const AddressStatus &b);
 
 /**
  * Tracks address query freshness.
+ * Busy addresses get checked often, while quiet ones back off.
  *
  * The long-term plan is to make this class work with the transaction cache.
- * It should be able to pick good poll frequencies for each address,
- * and should also generate new addresses based on the HD gap limit.
+ * It should also generate new addresses based on the HD gap limit.
  * This class should also cache its contents on disk,
  * avoiding the need to re-check everything on each login.
  *
@@ -86,10 +86,31 @@ public:
     load(JsonObject &json);
 
     /**
-     * Saves the database contents to the provided cache JSON object.
+     * Reads the database contents from a binary cache file.
      */
     Status
-    save(JsonObject &json);
+    load(CacheReader &serial);
+
+    /**
+     * Writes the database contents to a binary cache file.
+     * This also empties the journal.
+     */
+    void
+    save(CacheWriter &serial);
+
+    /**
+     * Writes the address rows that have changed since
+     * the last `save` or `journalSave` as a journal entry.
+     * @return false if nothing has changed.
+     */
+    bool
+    journalSave(CacheWriter &serial);
+
+    /**
+     * Replays a journal entry written by `journalSave`.
+     */
+    Status
+    journalLoad(CacheReader &serial);
 
     // Queries -------------------------------------------------------------
 
@@ -122,17 +143,35 @@ public:
     insert(const std::string &address, bool sweep=false);
 
     /**
-     * Begins checking the provided address at high speed.
-     * Pass a blank address to cancel the priority polling.
+     * Begins watching an address that might belong to us,
+     * such as one past the end of the HD gap limit.
+     * The row stays off disk unless `insert` claims it later.
+     */
+    void
+    insertLookahead(const std::string &address);
+
+    /**
+     * Stops watching an address added by `insertLookahead`.
+     * Claimed or used addresses stay put,
+     * since the journal can't record removals.
+     * @return false if the address has to stay.
+     */
+    bool
+    remove(const std::string &address);
+
+    /**
+     * Begins checking the provided address at high speed for a while.
+     * Several addresses can be prioritized at once.
+     * Pass a blank address to cancel all priority polling.
      */
     void
     prioritize(const std::string &address);
 
     /**
-     * Indicates that the transaction cache has been updated.
+     * Indicates that a transaction has arrived in the transaction cache.
      */
     void
-    update();
+    updateTx(const std::string &txid);
 
     /**
      * Updates an address with a new list of relevant transactions.
@@ -162,11 +201,20 @@ public:
 
     /**
      * Updates the state hash stored with the address.
-     * Returns true if the new hash differs from the old hash.
+     * A hash that matches our own transaction list counts as clean,
+     * even if it differs from the stored one.
+     * Returns true if the address needs a fresh history.
      */
     bool
     updateStratumHash(const std::string &address, const std::string &hash="");
 
+    /**
+     * Marks the addresses with unconfirmed transactions as dirty,
+     * since a new block might have confirmed them.
+     */
+    void
+    updateHeight();
+
     /**
      * Sets up a callback to notify when addresses change.
      * This wakes up the updater to check for new work.
@@ -189,7 +237,11 @@ public:
 private:
     mutable std::recursive_mutex mutex_; // The callbacks force this on us
     TxCache &txCache_;
-    std::string priorityAddress_;
+
+    /**
+     * Addresses being checked at high speed, with their expiration times.
+     */
+    std::map<std::string, time_t> priorityAddresses_;
 
     struct AddressRow
     {
@@ -204,6 +256,9 @@ private:
         bool complete = false; // True if all txids are known to the GUI.
         bool knownComplete = false; // True if `onComplete` has been called.
         bool sweep = false; // True if we don't own this address
+        bool lookahead = false; // True if nobody has claimed this address
+        time_t due = 0; // Our current position in `schedule_`
+        unsigned backoff = 0; // Doublings of the check period
 
         void
         insertTxid(const std::string &txid)
@@ -211,10 +266,55 @@ private:
             txids.insert(txid);
             complete = false;
             knownComplete = false;
+            backoff = 0; // New activity
+        }
+
+        bool
+        saved() const
+        {
+            return !sweep && !lookahead;
         }
     };
     std::map<std::string, AddressRow> rows_;
 
+    /**
+     * Every address, ordered by its next check time.
+     */
+    std::set<std::pair<time_t, std::string>> schedule_;
+
+    /**
+     * Addresses that are dirty or have incomplete transactions,
+     * and therefore need work regardless of the schedule.
+     */
+    std::set<std::string> pending_;
+
+    /**
+     * Maps each txid to the addresses that list it.
+     */
+    std::map<std::string, std::set<std::string>> txidAddresses_;
+
+    /**
+     * Maps each missing txid to the transactions waiting on it,
+     * either because it is their own txid or one of their inputs.
+     */
+    std::map<std::string, TxidSet> waiting_;
+
+    /**
+     * Listed transactions that are missing themselves or their inputs.
+     */
+    TxidSet blocked_;
+
+    /**
+     * Transactions and addresses that `updateInternal` needs to look at.
+     */
+    TxidSet unchecked_;
+    std::set<std::string> recheck_;
+
+    /**
+     * Addresses whose persistent state has changed since the last save.
+     */
+    std::set<std::string> journal_;
+
     /**
      * Transactions that are relevant, in the cache,
      * and that the GUI knows about.
@@ -225,13 +325,78 @@ private:
     TxidCallback onTx_;
     CompleteCallback onComplete_;
 
+    /**
+     * Picks the row's next check time.
+     * Priority addresses get checked quickly,
+     * while quiet addresses back off exponentially.
+     */
     time_t
     nextCheck(const std::string &address, const AddressRow &row) const;
 
+    /**
+     * Lengthens the row's check period after a check that found nothing,
+     * unless it has unconfirmed transactions to keep an eye on.
+     */
+    void
+    backoff(AddressRow &row);
+
     AddressStatus
     status(const std::string &address, const AddressRow &row,
            time_t now) const;
 
+    /**
+     * Updates the row's position in the schedule and the pending set.
+     * Call this after changing anything that affects `status`.
+     */
+    void
+    reschedule(const std::string &address, AddressRow &row);
+
+    /**
+     * Adds a txid to an address row, updating the indices.
+     */
+    void
+    txidInsert(const std::string &address, AddressRow &row,
+               const std::string &txid);
+
+    /**
+     * Queues up the transactions waiting on a newly-arrived txid.
+     */
+    void
+    wake(const std::string &txid);
+
+    /**
+     * Stores a freshly-loaded row, replacing any existing one.
+     */
+    void
+    rowInsert(const std::string &address, const AddressRow &row);
+
+    /**
+     * Computes the Electrum status hash for the row's transactions:
+     * the hex sha256 of "txid:height:" for each one, in block order,
+     * with unconfirmed transactions last.
+     * We don't know the order within a block or the mempool,
+     * so ties go by txid. A wrong guess just costs a history fetch.
+     */
+    std::string
+    localHash(const AddressRow &row) const;
+
+    /**
+     * Reads one address row from a binary cache file.
+     */
+    void
+    rowLoad(CacheReader &serial, time_t now);
+
+    /**
+     * Writes one address row to a binary cache file.
+     */
+    void
+    rowSave(CacheWriter &serial, const std::string &address,
+            const AddressRow &row) const;
+
+    /**
+     * Checks the queued transactions and addresses for completion,
+     * firing the callbacks as needed.
+     */
     void
     updateInternal();
 };
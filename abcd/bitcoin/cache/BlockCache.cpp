@@ -11,11 +11,27 @@
 #include "../../json/JsonArray.hpp"
 #include "../../json/JsonObject.hpp"
 #include "../../util/Debug.hpp"
+#include "../../util/FileIO.hpp"
 
 namespace abcd {
 
 constexpr time_t onHeaderTimeout = 5;
 
+/**
+ * The header file is a magic number followed by fixed-size records,
+ * appended in the order the headers arrive:
+ *
+ *  height  4 bytes
+ *  header  80 bytes, in the usual bitcoin format
+ *
+ * Wallets only need the headers for their own transactions,
+ * so the records are sparse rather than indexed by position.
+ */
+constexpr uint32_t headersMagic = 0xabcd4ead;
+constexpr size_t headersHeaderSize = 4;
+constexpr size_t headerSize = 80;
+constexpr size_t headerRecordSize = 4 + headerSize;
+
 struct BlockHeaderJson:
     public JsonObject
 {
@@ -32,8 +48,10 @@ struct BlockCacheJson:
     ABC_JSON_VALUE(headers, "headers", JsonArray)
 };
 
-BlockCache::BlockCache(const std::string &path):
+BlockCache::BlockCache(const std::string &path,
+                       const std::string &headersPath):
     path_(path),
+    headersPath_(headersPath),
     dirty_(false),
     height_(0)
 {
@@ -45,6 +63,8 @@ BlockCache::clear()
     std::lock_guard<std::mutex> lock(mutex_);
     height_ = 0;
     headers_.clear();
+    headersUnsaved_.clear();
+    headersFileOk_ = false;
     headersNeeded_.clear();
     dirty_ = true;
 }
@@ -53,11 +73,15 @@ Status
 BlockCache::load()
 {
     std::lock_guard<std::mutex> lock(mutex_);
+    headersLoad().log(); // Failure is fine
 
     BlockCacheJson json;
     ABC_CHECK(json.load(path_));
     height_ = json.height();
+    dirty_ = false;
 
+    // Older files keep the headers in the JSON,
+    // so move them over to the header file:
     auto headersJson = json.headers();
     size_t headersSize = headersJson.size();
     for (size_t i = 0; i < headersSize; i++)
@@ -70,11 +94,13 @@ BlockCache::load()
             bc::block_header_type header;
             ABC_CHECK(decodeHeader(header, rawHeader));
 
-            headers_[blockHeaderJson.height()] = std::move(header);
+            const size_t height = blockHeaderJson.height();
+            if (headers_.emplace(height, std::move(header)).second)
+                headersUnsaved_.push_back(height);
+            dirty_ = true;
         }
     }
 
-    dirty_ = false;
     return Status();
 }
 
@@ -83,24 +109,13 @@ BlockCache::save()
 {
     std::lock_guard<std::mutex> lock(mutex_);
 
+    // The headers go first, so a migrated JSON file never loses them:
+    ABC_CHECK(headersSave());
+
     if (dirty_)
     {
         BlockCacheJson json;
         ABC_CHECK(json.heightSet(height_));
-
-        JsonArray headersJson;
-        for (const auto &header: headers_)
-        {
-            bc::data_chunk rawHeader(satoshi_raw_size(header.second));
-            bc::satoshi_save(header.second, rawHeader.begin());
-
-            BlockHeaderJson blockHeaderJson;
-            ABC_CHECK(blockHeaderJson.heightSet(header.first));
-            ABC_CHECK(blockHeaderJson.headerSet(base64Encode(rawHeader)));
-            ABC_CHECK(headersJson.append(blockHeaderJson));
-        }
-        ABC_CHECK(json.headersSet(headersJson));
-
         ABC_CHECK(json.save(path_));
         dirty_ = false;
     }
@@ -161,7 +176,7 @@ BlockCache::headerInsert(size_t height, const bc::block_header_type &header)
     {
         ABC_DebugLog("Adding header %d", height);
         headers_[height] = header;
-        dirty_ = true;
+        headersUnsaved_.push_back(height);
         headersDirty_ = true;
 
         return true;
@@ -199,24 +214,33 @@ BlockCache::onHeaderInvoke(void)
     }
 }
 
-size_t
-BlockCache::headerNeeded()
+std::set<size_t>
+BlockCache::headerChunkNeeded(size_t chunkSize)
 {
     std::unique_lock<std::mutex> lock(mutex_);
+    std::set<size_t> out;
 
-    while (!headersNeeded_.empty())
-    {
-        // Pull an item from the set:
-        const auto out = *headersNeeded_.begin();
+    // Unconfirmed transactions ask for height 0, which isn't a real request:
+    headersNeeded_.erase(0);
+
+    // Skip past anything we have already:
+    while (!headersNeeded_.empty() &&
+            headers_.count(*headersNeeded_.begin()))
         headersNeeded_.erase(headersNeeded_.begin());
+    if (headersNeeded_.empty())
+        return out;
 
-        // Only return the item if it is truly missing:
-        if (headers_.end() == headers_.find(out))
-            return out;
+    // Grab everything else in the same chunk, which sorts together:
+    const auto first = *headersNeeded_.begin() / chunkSize * chunkSize;
+    auto i = headersNeeded_.begin();
+    while (headersNeeded_.end() != i && *i < first + chunkSize)
+    {
+        if (!headers_.count(*i))
+            out.insert(*i);
+        i = headersNeeded_.erase(i);
     }
 
-    // There is none:
-    return 0;
+    return out;
 }
 
 void
@@ -226,4 +250,77 @@ BlockCache::headerNeededAdd(size_t height)
     headersNeeded_.insert(height);
 }
 
+Status
+BlockCache::headersLoad()
+{
+    headersFileOk_ = false;
+
+    DataChunk file;
+    ABC_CHECK(fileLoad(file, headersPath_));
+    auto serial = bc::make_deserializer(file.data(), file.data() + file.size());
+
+    try
+    {
+        if (headersMagic != serial.read_4_bytes())
+            return ABC_ERROR(ABC_CC_ParseError, "Unknown header file header");
+
+        // A torn record at the end means the file needs a rewrite:
+        const size_t count = (file.size() - headersHeaderSize) / headerRecordSize;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const size_t height = serial.read_4_bytes();
+            const auto rawHeader = serial.read_data(headerSize);
+
+            bc::block_header_type header;
+            ABC_CHECK(decodeHeader(header, rawHeader));
+            headers_[height] = std::move(header);
+        }
+        if (headersHeaderSize + count * headerRecordSize != file.size())
+            return ABC_ERROR(ABC_CC_ParseError, "Torn header file record");
+    }
+    catch (bc::end_of_stream)
+    {
+        return ABC_ERROR(ABC_CC_ParseError, "Truncated header file");
+    }
+
+    headersFileOk_ = true;
+    return Status();
+}
+
+Status
+BlockCache::headersSave()
+{
+    if (headersFileOk_ && headersUnsaved_.empty())
+        return Status();
+
+    // Append the new headers, or start over if the file is bad:
+    const bool append = headersFileOk_;
+    DataChunk out;
+    auto serial = bc::make_serializer(std::back_inserter(out));
+    const auto recordSave = [&serial](size_t height,
+                                      const bc::block_header_type &header)
+    {
+        bc::data_chunk rawHeader(satoshi_raw_size(header));
+        bc::satoshi_save(header, rawHeader.begin());
+        serial.write_4_bytes(height);
+        serial.write_data(rawHeader);
+    };
+    if (append)
+    {
+        for (const auto height: headersUnsaved_)
+            recordSave(height, headers_[height]);
+    }
+    else
+    {
+        serial.write_4_bytes(headersMagic);
+        for (const auto &header: headers_)
+            recordSave(header.first, header.second);
+    }
+
+    ABC_CHECK(fileAppendOrSave(headersFileOk_, out, headersPath_));
+    headersUnsaved_.clear();
+
+    return Status();
+}
+
 } // namespace abcd
@@ -11,9 +11,10 @@
 #include "../../util/Status.hpp"
 #include <bitcoin/bitcoin.hpp>
 #include <functional>
-#include <map>
 #include <mutex>
 #include <set>
+#include <unordered_map>
+#include <vector>
 
 namespace abcd {
 
@@ -28,7 +29,7 @@ public:
 
     // Lifetime ------------------------------------------------------------
 
-    BlockCache(const std::string &path);
+    BlockCache(const std::string &path, const std::string &headersPath);
 
     /**
      * Clears the cache in case something goes wrong.
@@ -44,6 +45,7 @@ public:
 
     /**
      * Saves the database contents to disk, but only if there are changes.
+     * New headers are appended to the header file, leaving the rest alone.
      */
     Status
     save();
@@ -100,10 +102,13 @@ public:
 
     /**
      * Returns the next requested block header missing from the cache,
-     * or zero if there is none.
+     * along with any others in the same `chunkSize`-aligned range,
+     * so they can all be fetched together.
+     * These are removed from the missing list.
+     * Returns an empty set if there are none.
      */
-    size_t
-    headerNeeded();
+    std::set<size_t>
+    headerChunkNeeded(size_t chunkSize);
 
     /**
      * Requests that a particular block header be added to the cache.
@@ -112,8 +117,22 @@ public:
     headerNeededAdd(size_t height);
 
 private:
+    /**
+     * Reads the header file into memory.
+     */
+    Status
+    headersLoad();
+
+    /**
+     * Appends any new headers to the header file,
+     * or rewrites the whole thing if the file is bad.
+     */
+    Status
+    headersSave();
+
     mutable std::mutex mutex_;
     const std::string path_;
+    const std::string headersPath_;
     bool dirty_;
 
     // Chain height:
@@ -121,7 +140,9 @@ private:
     HeightCallback onHeight_;
 
     // Chain headers:
-    std::map<size_t, libbitcoin::block_header_type> headers_;
+    std::unordered_map<size_t, libbitcoin::block_header_type> headers_;
+    std::vector<size_t> headersUnsaved_;
+    bool headersFileOk_ = false; // False if the next save needs a rewrite
     bool headersDirty_ = false;
     time_t onHeaderLastCall_ = 0;
     HeaderCallback onHeader_;
@@ -8,16 +8,60 @@
 #include "Cache.hpp"
 #include "../../json/JsonObject.hpp"
 #include "../../util/FileIO.hpp"
+#include <zlib.h>
+#include <functional>
 
 namespace abcd {
 
+/**
+ * The binary cache file starts with this header,
+ * followed by the (possibly deflated) payload:
+ *
+ *  magic    4 bytes
+ *  version  1 byte
+ *  flags    1 byte
+ *  size     8 bytes, the payload size before compression
+ *
+ * The payload holds the addressCheckDone byte, followed by
+ * the transaction section and the address section.
+ * The transaction section only holds txids,
+ * and leaves the transaction data to the app-wide `TxStore`.
+ */
+constexpr uint32_t cacheMagic = 0xabcdcace;
+constexpr uint8_t cacheVersion = 2;
+constexpr size_t cacheHeaderSize = 4 + 1 + 1 + 8;
+
+enum CacheFlags: uint8_t
+{
+    cacheFlagDeflate = 1 << 0
+};
+
+/**
+ * The journal sits next to the snapshot and holds the changes made
+ * since the snapshot was written. It starts with its own header:
+ *
+ *  magic         4 bytes
+ *  snapshot crc  4 bytes, the CRC-32 of the snapshot file it extends
+ *
+ * followed by one entry per save:
+ *
+ *  size   4 bytes
+ *  crc    4 bytes, the CRC-32 of the entry data
+ *  data   the addressCheckDone byte, then the tx and address changes
+ */
+constexpr uint32_t journalMagic = 0xabcd10c0;
+constexpr size_t journalHeaderSize = 4 + 4;
+constexpr size_t journalEntryHeaderSize = 4 + 4;
+
 Cache::Cache(const std::string &path, BlockCache &blockCache,
-             ServerCache &serverCache):
-    txs(blockCache),
+             TxStore &txStore, ServerCache &serverCache):
+    txs(blockCache, txStore),
     blocks(blockCache),
     addresses(txs),
     servers(serverCache),
+    txStore_(txStore),
     path_(path),
+    journalPath_(path + "-journal"),
     addressCheckDone_(false)
 {
 }
@@ -29,18 +73,188 @@ Cache::clear()
     blocks.save();
     txs.clear();
     servers.clear();
-    save();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshotSave();
+}
+
+/**
+ * Checks a snapshot file's header and returns its inflated payload.
+ */
+static Status
+snapshotDecode(DataChunk &result, DataSlice file)
+{
+    auto serial = bc::make_deserializer(file.begin(), file.end());
+
+    try
+    {
+        // Header:
+        if (cacheMagic != serial.read_4_bytes())
+            return ABC_ERROR(ABC_CC_ParseError, "Unknown cache file header");
+        if (cacheVersion != serial.read_byte())
+            return ABC_ERROR(ABC_CC_ParseError, "Unknown cache file version");
+        const auto flags = serial.read_byte();
+        const auto size = serial.read_8_bytes();
+
+        // Payload:
+        DataSlice payload(serial.iterator(), file.end());
+        if (flags & cacheFlagDeflate)
+        {
+            // Deflate cannot do better than about 1032:1,
+            // so anything bigger is a corrupt header:
+            if (payload.size() * 1032 < size)
+                return ABC_ERROR(ABC_CC_ParseError, "Corrupt cache file");
+
+            result.resize(size);
+            uLongf inflatedSize = size;
+            if (Z_OK != uncompress(result.data(), &inflatedSize,
+                                   payload.data(), payload.size()) ||
+                    size != inflatedSize)
+                return ABC_ERROR(ABC_CC_ParseError, "Corrupt cache file");
+        }
+        else if (size != payload.size())
+        {
+            return ABC_ERROR(ABC_CC_ParseError, "Truncated cache file");
+        }
+        else
+        {
+            result.assign(payload.begin(), payload.end());
+        }
+    }
+    catch (bc::end_of_stream)
+    {
+        return ABC_ERROR(ABC_CC_ParseError, "Truncated cache file");
+    }
+
+    return Status();
+}
+
+/**
+ * Hands each entry of a journal file to the callback,
+ * as long as the journal extends the snapshot with this CRC.
+ */
+static Status
+journalDecode(DataSlice file, uint32_t snapshotCrc,
+              std::function<Status (CacheReader &reader)> onEntry)
+{
+    auto serial = bc::make_deserializer(file.begin(), file.end());
+
+    try
+    {
+        // Header:
+        if (journalMagic != serial.read_4_bytes())
+            return ABC_ERROR(ABC_CC_ParseError, "Unknown cache journal header");
+        if (snapshotCrc != serial.read_4_bytes())
+            return ABC_ERROR(ABC_CC_ParseError, "Stale cache journal");
+        size_t offset = journalHeaderSize;
+
+        // Entries:
+        while (offset < file.size())
+        {
+            const size_t size = serial.read_4_bytes();
+            const uint32_t crc = serial.read_4_bytes();
+            const uint8_t *begin = serial.iterator();
+            if (file.size() - offset - journalEntryHeaderSize < size ||
+                    crc != crc32(0, begin, size))
+                return ABC_ERROR(ABC_CC_ParseError, "Torn cache journal entry");
+
+            CacheReader reader(begin, begin + size);
+            ABC_CHECK(onEntry(reader));
+
+            serial.set_iterator(serial.iterator() + size);
+            offset += journalEntryHeaderSize + size;
+        }
+    }
+    catch (bc::end_of_stream)
+    {
+        return ABC_ERROR(ABC_CC_ParseError, "Truncated cache journal");
+    }
+
+    return Status();
 }
 
 Status
 Cache::load()
 {
-    JsonObject cacheJson;
+    std::lock_guard<std::mutex> lock(mutex_);
     servers.serverCacheLoad();
-    ABC_CHECK(cacheJson.load(path_));
+
+    DataChunk file;
+    ABC_CHECK(fileLoad(file, path_));
+    DataChunk payload;
+    ABC_CHECK(snapshotDecode(payload, file));
+
+    try
+    {
+        CacheReader reader(payload.data(), payload.data() + payload.size());
+        addressCheckDone_ = reader.read_byte();
+        ABC_CHECK(txs.load(reader));
+        ABC_CHECK(addresses.load(reader));
+    }
+    catch (bc::end_of_stream)
+    {
+        return ABC_ERROR(ABC_CC_ParseError, "Truncated cache file");
+    }
+    snapshotCrc_ = crc32(0, file.data(), file.size());
+    snapshotSize_ = file.size();
+
+    // Bring the snapshot up to date (failure is fine):
+    journalLoad().log();
+    savedCheckDone_ = addressCheckDone_;
+
+    return Status();
+}
+
+Status
+Cache::txidsLoad(TxStore::Txids &result, const std::string &path)
+{
+    DataChunk file;
+    ABC_CHECK(fileLoad(file, path));
+    DataChunk payload;
+    ABC_CHECK(snapshotDecode(payload, file));
+
+    TxStore::Txids txids;
+    try
+    {
+        CacheReader reader(payload.data(), payload.data() + payload.size());
+        (void)reader.read_byte(); // addressCheckDone
+        TxCache::txidsLoad(txids, reader);
+    }
+    catch (bc::end_of_stream)
+    {
+        return ABC_ERROR(ABC_CC_ParseError, "Truncated cache file");
+    }
+
+    // Apply the journal, which can also drop transactions.
+    // Anything after a torn entry never happened (failure is fine):
+    DataChunk journal;
+    if (fileLoad(journal, path + "-journal"))
+    {
+        const auto snapshotCrc = crc32(0, file.data(), file.size());
+        journalDecode(journal, snapshotCrc, [&txids](CacheReader &reader) -> Status
+        {
+            (void)reader.read_byte(); // addressCheckDone
+            TxCache::txidsJournalLoad(txids, reader);
+            return Status();
+        }).log();
+    }
+
+    result.insert(txids.begin(), txids.end());
+    return Status();
+}
+
+Status
+Cache::loadJson(const std::string &path)
+{
+    JsonObject cacheJson;
+    ABC_CHECK(cacheJson.load(path));
     ABC_CHECK(txs.load(cacheJson));
     ABC_CHECK(addresses.load(cacheJson));
     addressCheckDoneLoad(cacheJson);
+
+    // The first binary save replaces this file:
+    std::lock_guard<std::mutex> lock(mutex_);
+    jsonPath_ = path;
     return Status();
 }
 
@@ -62,12 +276,6 @@ Cache::addressCheckDoneLoad(JsonObject &json)
     addressCheckDone_ = json.getBoolean("addressCheckDone", false);
 }
 
-Status
-Cache::addressCheckDoneSave(JsonObject &json)
-{
-    return json.set("addressCheckDone", addressCheckDone_);
-}
-
 Status
 Cache::loadLegacy(const std::string &path)
 {
@@ -97,7 +305,7 @@ Cache::loadLegacy(const std::string &path)
             if (0x42 != serial.read_byte())
                 return ABC_ERROR(ABC_CC_ParseError, "Unknown cache entry");
 
-            auto txid = bc::encode_hash(serial.read_hash());
+            const auto hash = serial.read_hash();
             bc::transaction_type tx;
             bc::satoshi_load(serial.iterator(), data.end(), tx);
             const auto step = serial.iterator() + satoshi_raw_size(tx);
@@ -123,6 +331,10 @@ Cache::loadLegacy(const std::string &path)
             if (malleated && !masterConfirm)
                 height = 0;
 
+            if (!TxCache::hashMatches(tx, hash, "legacy"))
+                continue;
+
+            const auto txid = bc::encode_hash(hash);
             txids.insert(txid);
             txs.insert(tx, txid);
             txs.confirmed(txid, height, timestamp);
@@ -148,11 +360,109 @@ Cache::loadLegacy(const std::string &path)
 Status
 Cache::save()
 {
-    JsonObject cacheJson;
-    ABC_CHECK(txs.save(cacheJson));
-    ABC_CHECK(addresses.save(cacheJson));
-    ABC_CHECK(addressCheckDoneSave(cacheJson));
-    ABC_CHECK(cacheJson.save(path_));
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Anything missing from the store just gets fetched again,
+    // so this failure is fine:
+    txStore_.save().log();
+
+    if (!journalOk_)
+        return snapshotSave();
+
+    // Gather the changes since the last save:
+    DataChunk entry;
+    CacheWriter writer(std::back_inserter(entry));
+    writer.write_byte(addressCheckDone_);
+    const bool txsChanged = txs.journalSave(writer);
+    const bool addressesChanged = addresses.journalSave(writer);
+    if (!txsChanged && !addressesChanged &&
+            savedCheckDone_ == addressCheckDone_)
+        return Status();
+
+    // Once the journal outgrows the snapshot, fold it back in:
+    const auto entrySize = journalEntryHeaderSize + entry.size();
+    if (snapshotSize_ < journalSize_ + entrySize)
+        return snapshotSave();
+
+    DataChunk out(journalEntryHeaderSize);
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_4_bytes(entry.size());
+    serial.write_4_bytes(crc32(0, entry.data(), entry.size()));
+    out.insert(out.end(), entry.begin(), entry.end());
+
+    ABC_CHECK(fileAppendOrSave(journalOk_, out, journalPath_));
+    journalSize_ += out.size();
+    savedCheckDone_ = addressCheckDone_;
+
+    return Status();
+}
+
+Status
+Cache::journalLoad()
+{
+    journalOk_ = false;
+
+    DataChunk file;
+    ABC_CHECK(fileLoad(file, journalPath_));
+    ABC_CHECK(journalDecode(file, snapshotCrc_, [this](CacheReader &reader) -> Status
+    {
+        addressCheckDone_ = reader.read_byte();
+        ABC_CHECK(txs.journalLoad(reader));
+        ABC_CHECK(addresses.journalLoad(reader));
+        return Status();
+    }));
+    journalSize_ = file.size();
+
+    journalOk_ = true;
+    return Status();
+}
+
+Status
+Cache::snapshotSave()
+{
+    journalOk_ = false;
+
+    DataChunk payload;
+    CacheWriter writer(std::back_inserter(payload));
+    writer.write_byte(addressCheckDone_);
+    txs.save(writer);
+    addresses.save(writer);
+
+    // Compress the payload in place after the header:
+    uLongf deflatedSize = compressBound(payload.size());
+    DataChunk file(cacheHeaderSize + deflatedSize);
+    if (Z_OK != compress(file.data() + cacheHeaderSize, &deflatedSize,
+                         payload.data(), payload.size()))
+        return ABC_ERROR(ABC_CC_Error, "Cannot compress the cache");
+    file.resize(cacheHeaderSize + deflatedSize);
+
+    auto serial = bc::make_serializer(file.begin());
+    serial.write_4_bytes(cacheMagic);
+    serial.write_byte(cacheVersion);
+    serial.write_byte(cacheFlagDeflate);
+    serial.write_8_bytes(payload.size());
+
+    ABC_CHECK(fileSave(file, path_));
+    snapshotCrc_ = crc32(0, file.data(), file.size());
+    snapshotSize_ = file.size();
+    savedCheckDone_ = addressCheckDone_;
+
+    // Start an empty journal on top of the new snapshot:
+    DataChunk journal(journalHeaderSize);
+    auto journalSerial = bc::make_serializer(journal.begin());
+    journalSerial.write_4_bytes(journalMagic);
+    journalSerial.write_4_bytes(snapshotCrc_);
+    ABC_CHECK(fileSave(journal, journalPath_));
+    journalSize_ = journal.size();
+    journalOk_ = true;
+
+    // The binary cache is safely on disk, so the migrated file can go:
+    if (!jsonPath_.empty())
+    {
+        fileDelete(jsonPath_).log();
+        jsonPath_.clear();
+    }
+
     return Status();
 }
 
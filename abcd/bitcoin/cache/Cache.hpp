@@ -11,7 +11,9 @@
 #include "AddressCache.hpp"
 #include "BlockCache.hpp"
 #include "TxCache.hpp"
+#include "TxStore.hpp"
 #include "ServerCache.hpp"
+#include <mutex>
 
 namespace abcd {
 
@@ -24,7 +26,7 @@ public:
     ServerCache &servers;
 
     Cache(const std::string &path, BlockCache &blockCache,
-          ServerCache &serverCache);
+          TxStore &txStore, ServerCache &serverCache);
 
     /**
      * Sets the address check done for this wallet meaning that
@@ -54,25 +56,46 @@ public:
     Status
     load();
 
+    /**
+     * Loads the cache from the older JSON format.
+     * The file is deleted once the next save writes the binary format.
+     */
+    Status
+    loadJson(const std::string &path);
+
     /**
      * Loads the cache from the legacy format.
      */
     Status
     loadLegacy(const std::string &path);
 
+    /**
+     * Adds the txids that a cache file on disk refers to,
+     * without loading the cache.
+     */
+    static Status
+    txidsLoad(TxStore::Txids &result, const std::string &path);
+
     /**
      * Saves the cache to disk.
+     * This normally appends the recent changes to a journal,
+     * but writes a fresh snapshot once the journal grows too big.
      */
     Status
     save();
 
 private:
+    /**
+     * Replays the journal on top of a freshly-loaded snapshot.
+     */
+    Status
+    journalLoad();
 
     /**
-     * Save the status of addressCheckDone in the cache
+     * Writes the whole cache to disk, emptying the journal.
      */
     Status
-    addressCheckDoneSave(JsonObject &json);
+    snapshotSave();
 
     /**
      * Load the status of addressCheckDone from the cache
@@ -80,8 +103,21 @@ private:
     void
     addressCheckDoneLoad(JsonObject &json);
 
+    TxStore &txStore_;
     const std::string path_;
+    const std::string journalPath_;
     bool addressCheckDone_;
+
+    // Journal state.
+    // Lock order: this mutex first, then the TxCache or AddressCache lock,
+    // so nothing may save the cache from inside their callbacks:
+    std::mutex mutex_;
+    bool journalOk_ = false; // False if the next save needs a snapshot
+    bool savedCheckDone_ = false;
+    uint32_t snapshotCrc_ = 0;
+    size_t snapshotSize_ = 0;
+    size_t journalSize_ = 0;
+    std::string jsonPath_; // Migrated file to delete after the next snapshot
 };
 
 } // namespace abcd
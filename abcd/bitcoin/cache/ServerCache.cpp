@@ -22,6 +22,13 @@ constexpr auto STRATUM_PREFIX_LENGTH = 10;
 constexpr auto MAX_SCORE = 500;
 constexpr auto MIN_SCORE = -100;
 
+// Latency tracking:
+constexpr double latencyWeight = 0.2;
+constexpr double errorWeight = 0.1;
+constexpr double maxErrorRate = 0.9;
+constexpr unsigned histogramDecay = 128;
+constexpr double defaultResponseTime = 1000;
+
 #define RESPONSE_TIME_UNINITIALIZED 999999999
 
 /**
@@ -69,6 +76,64 @@ struct ServerScoreJson:
                      RESPONSE_TIME_UNINITIALIZED)
 };
 
+void
+ServerLatency::add(unsigned long long responseTime)
+{
+    average = samples ?
+              average + latencyWeight * (responseTime - average) :
+              responseTime;
+    errorRate -= errorWeight * errorRate;
+    ++samples;
+
+    size_t bucket = 0;
+    while (bucket + 1 < buckets && (2ull << bucket) <= responseTime)
+        ++bucket;
+    ++histogram[bucket];
+
+    // Halve everything once in a while, so recent samples dominate:
+    unsigned total = 0;
+    for (const auto count: histogram)
+        total += count;
+    if (histogramDecay <= total)
+        for (auto &count: histogram)
+            count /= 2;
+}
+
+void
+ServerLatency::addError()
+{
+    errorRate += errorWeight * (1 - errorRate);
+}
+
+void
+ServerLatency::merge(const ServerLatency &other)
+{
+    if (samples + other.samples)
+        average = (average * samples + other.average * other.samples) /
+                  (samples + other.samples);
+    errorRate = std::max(errorRate, other.errorRate);
+    samples += other.samples;
+    for (size_t i = 0; i < buckets; ++i)
+        histogram[i] += other.histogram[i];
+}
+
+unsigned long long
+ServerLatency::percentile(double fraction) const
+{
+    unsigned total = 0;
+    for (const auto count: histogram)
+        total += count;
+
+    unsigned seen = 0;
+    for (size_t i = 0; i < buckets; ++i)
+    {
+        seen += histogram[i];
+        if (total && fraction * total <= seen)
+            return 2ull << i;
+    }
+    return 0;
+}
+
 ServerCache::ServerCache(const std::string &path):
     path_(path),
     dirty_(false),
@@ -127,7 +192,9 @@ ServerCache::serverCacheLoad()
         }
     }
 
-    // Load the servers into the servers_ map
+    // Load the servers into the servers_ map,
+    // keeping any latency history from this session:
+    auto oldServers = std::move(servers_);
     servers_.clear();
 
     size_t numServers = serverScoresJsonArray.size();
@@ -170,6 +237,9 @@ ServerCache::serverCacheLoad()
             serverInfo.score = serverScore;
         serverInfo.responseTime = serverResponseTime;
         serverInfo.numResponseTimes = 0;
+        const auto old = oldServers.find(serverUrl);
+        if (oldServers.end() != old)
+            serverInfo.latency = old->second.latency;
         servers_[serverUrl] = serverInfo;
         ABC_DebugLevel(1, "ServerCache::load %d %d ms %s",
                        serverInfo.score, serverInfo.responseTime, serverInfo.serverUrl.c_str())
@@ -295,14 +365,18 @@ ServerCache::getCurrentTimeMilliSeconds()
 
 void
 ServerCache::setResponseTime(std::string serverUrl,
-                             unsigned long long responseTimeMilliseconds)
+                             unsigned long long responseTimeMilliseconds,
+                             ServerRequest request)
 {
+    std::lock_guard<std::mutex> lock(mutex_);
+
     // Collects that last 10 response time values to provide an average response time.
     // This is used in weighting the score of a particular server
     auto svr = servers_.find(serverUrl);
     if (servers_.end() != svr)
     {
         ServerInfo serverInfo = svr->second;
+        serverInfo.latency[request].add(responseTimeMilliseconds);
         serverInfo.numResponseTimes++;
 
         unsigned long long oldtime = serverInfo.responseTime;
@@ -330,6 +404,66 @@ ServerCache::setResponseTime(std::string serverUrl,
     }
 }
 
+void
+ServerCache::setResponseError(const std::string &serverUrl,
+                              ServerRequest request)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto svr = servers_.find(serverUrl);
+    if (servers_.end() != svr)
+        svr->second.latency[request].addError();
+}
+
+double
+ServerCache::expectedResponseTime(const std::string &serverUrl,
+                                  ServerRequest request) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto svr = servers_.find(serverUrl);
+    if (servers_.end() == svr)
+        return defaultResponseTime;
+    const auto &info = svr->second;
+
+    // Use the most specific history we have:
+    ServerLatency latency = info.latency[request];
+    if (!latency.samples)
+        for (const auto &other: info.latency)
+            latency.merge(other);
+
+    double out = latency.samples ? latency.average :
+                 RESPONSE_TIME_UNINITIALIZED != info.responseTime ?
+                 info.responseTime : defaultResponseTime;
+
+    // Each failure costs another round trip:
+    return out / (1 - std::min(latency.errorRate, maxErrorRate));
+}
+
+ServerLatency
+ServerCache::latency(const std::string &serverUrl) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    ServerLatency out;
+    auto svr = servers_.find(serverUrl);
+    if (servers_.end() != svr)
+        for (const auto &latency: svr->second.latency)
+            out.merge(latency);
+    return out;
+}
+
+ServerLatency
+ServerCache::latency(const std::string &serverUrl, ServerRequest request) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto svr = servers_.find(serverUrl);
+    if (servers_.end() == svr)
+        return ServerLatency();
+    return svr->second.latency[request];
+}
+
 std::vector<std::string>
 ServerCache::getServers(ServerType type, unsigned int numServersWanted)
 {
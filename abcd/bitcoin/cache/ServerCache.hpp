@@ -10,6 +10,7 @@
 
 #include "../../util/Status.hpp"
 #include <bitcoin/bitcoin.hpp>
+#include <array>
 #include <functional>
 #include <map>
 #include <mutex>
@@ -24,12 +25,54 @@ typedef enum
     ServerTypeAirbitz
 } ServerType;
 
+typedef enum
+{
+    ServerRequestHeight,
+    ServerRequestAddress,
+    ServerRequestTx,
+    ServerRequestHeader,
+    ServerRequestOther,
+    ServerRequestTypes // The number of request types
+} ServerRequest;
+
+/**
+ * Response-time statistics for one kind of request to one server.
+ * The histogram uses power-of-two buckets, and decays over time
+ * so old samples eventually stop mattering.
+ */
+struct ServerLatency
+{
+    static constexpr size_t buckets = 18; // Up to 2^17 ms, about 2 minutes
+
+    double average = 0; // Moving average, in ms
+    double errorRate = 0; // Moving average, from 0 to 1
+    unsigned samples = 0;
+    std::array<unsigned, buckets> histogram{};
+
+    void
+    add(unsigned long long responseTime);
+
+    void
+    addError();
+
+    void
+    merge(const ServerLatency &other);
+
+    /**
+     * Returns the response time that this fraction of replies beat,
+     * rounded up to the bucket boundary.
+     */
+    unsigned long long
+    percentile(double fraction) const;
+};
+
 typedef struct
 {
     std::string serverUrl;
     int score;
     unsigned long responseTime;
     unsigned long numResponseTimes;
+    std::array<ServerLatency, ServerRequestTypes> latency;
 } ServerInfo;
 
 /**
@@ -78,7 +121,36 @@ public:
      */
     void
     setResponseTime(std::string serverUrl,
-                    unsigned long long responseTimeMilliseconds);
+                    unsigned long long responseTimeMilliseconds,
+                    ServerRequest request=ServerRequestOther);
+
+    /**
+     * Records a failed request to this server.
+     */
+    void
+    setResponseError(const std::string &serverUrl, ServerRequest request);
+
+    /**
+     * Estimates how long this server will take to answer a request,
+     * counting the retries needed for its failures.
+     * Falls back on the server's other request types,
+     * and then on its saved response time, if there is no history.
+     */
+    double
+    expectedResponseTime(const std::string &serverUrl,
+                         ServerRequest request) const;
+
+    /**
+     * Returns the combined statistics for all of a server's request types.
+     */
+    ServerLatency
+    latency(const std::string &serverUrl) const;
+
+    /**
+     * Returns the statistics for one of a server's request types.
+     */
+    ServerLatency
+    latency(const std::string &serverUrl, ServerRequest request) const;
 
     /**
      * Get a vector of server URLs by type. This returns the top 'numServers' of servers with
@@ -12,30 +12,43 @@
 #include "../../json/JsonArray.hpp"
 #include "../../json/JsonObject.hpp"
 #include "../../util/Debug.hpp"
-#include <unordered_set>
 
-namespace std {
+namespace abcd {
 
 /**
- * Allows `bc::point_type` to be used with `std::unordered_set`.
+ * Returns true if the transaction has incoming non-change funds.
  */
-template<> struct hash<bc::point_type>
+static bool
+isIncoming(const bc::transaction_type &tx, size_t height,
+           const AddressSet &addresses)
 {
-    typedef bc::point_type argument_type;
-    typedef std::size_t result_type;
+    // Confirmed transactions are no longer incoming:
+    if (height)
+        return false;
 
-    result_type
-    operator()(argument_type const &p) const
+    // This is a spend if we control all the inputs:
+    for (auto &input: tx.inputs)
     {
-        auto h = libbitcoin::from_little_endian_unsafe<result_type>(
-                     p.hash.begin());
-        return h ^ p.index;
+        bc::payment_address address;
+        if (!bc::extract(address, input.script) ||
+                !addresses.count(address.encoded()))
+            return true;
     }
-};
-
-} // namespace std
+    return false;
+}
 
-namespace abcd {
+/**
+ * Keeps coin selection deterministic, whatever the index order.
+ */
+static void
+sortOutputs(TxOutputList &utxos)
+{
+    utxos.sort([](const TxOutput &a, const TxOutput &b)
+    {
+        return a.point.hash < b.point.hash ||
+               (a.point.hash == b.point.hash && a.point.index < b.point.index);
+    });
+}
 
 libbitcoin::output_info_list
 filterOutputs(const TxOutputList &utxos, bool filter)
@@ -55,84 +68,94 @@ filterOutputs(const TxOutputList &utxos, bool filter)
     return out;
 }
 
-typedef std::unordered_set<bc::point_type> PointSet;
+Status
+TxSnapshot::info(TxInfo &result, const std::string &txid) const
+{
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return ABC_ERROR(ABC_CC_ParseError, "Bad txid " + txid);
+    const auto entry = find(hash);
+    if (!entry)
+        return ABC_ERROR(ABC_CC_Synchronizing, "Cannot find transaction");
+    if (!entry->info)
+        return ABC_ERROR(ABC_CC_Synchronizing, "Missing inputs");
+
+    result = *entry->info;
+    return Status();
+}
+
+Status
+TxSnapshot::status(TxStatus &result, const std::string &txid) const
+{
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return ABC_ERROR(ABC_CC_ParseError, "Bad txid " + txid);
+    const auto entry = find(hash);
 
-/**
- * Knows how to check a transaction for double-spends and other problems.
- * This uses a memoized recursive function to do the graph search,
- * so the more checks this object performs,
- * the faster those checks can potentially become (for a fixed graph).
- */
-class TxGraph
+    result = entry ? entry->status : TxStatus();
+    return Status();
+}
+
+std::list<std::pair<TxInfo, TxStatus> >
+TxSnapshot::statuses(const TxidSet &txids) const
 {
-public:
-    static constexpr unsigned doubleSpent = 1 << 0;
-    static constexpr unsigned replaceByFee = 1 << 1;
+    std::list<std::pair<TxInfo, TxStatus>> out;
 
-    TxGraph(const TxCache &cache):
-        cache_(cache)
+    for (const auto &txid: txids)
     {
-        for (auto &row: cache_.txs_)
-        {
-            for (auto &input: row.second.inputs)
-            {
-                if (!spends_.insert(input.previous_output).second)
-                    doubleSpends_.insert(input.previous_output);
-            }
-        }
+        bc::hash_digest hash;
+        const auto entry = bc::decode_hash(hash, txid) ? find(hash) : nullptr;
+        if (entry && entry->info)
+            out.push_back(std::make_pair(*entry->info, entry->status));
     }
 
-    /**
-     * Returns true if the output point has been spent from.
-     */
-    bool isSpent(bc::output_point point)
+    return out;
+}
+
+TxOutputList
+TxSnapshot::utxos(const AddressSet &addresses) const
+{
+    TxOutputList out;
+    if (!unspent_)
+        return out;
+
+    for (const auto &address: addresses)
     {
-        return spends_.count(point);
-    }
+        auto points = unspent_->find(address);
+        if (unspent_->end() == points)
+            continue;
 
-    /**
-     * Recursively checks the transaction graph for problems.
-     * @return A bitfield containing problem flags.
-     */
-    unsigned
-    problems(const std::string &txid)
-    {
-        // Just use the previous result if we have been here before:
-        auto vi = visited_.find(txid);
-        if (visited_.end() != vi)
-            return vi->second;
-
-        // We have to assume missing transactions are safe:
-        auto i = cache_.txs_.find(txid);
-        if (cache_.txs_.end() == i)
-            return (visited_[txid] = 0);
-
-        // Confirmed transactions are also safe:
-        if (cache_.txidHeight(txid))
-            return (visited_[txid] = 0);
-
-        // Check for the opt-in replace-by-fee flag:
-        unsigned out = 0;
-        if (isReplaceByFee(i->second))
-            out |= replaceByFee;
-
-        // Recursively check all the inputs:
-        for (const auto &input: i->second.inputs)
+        for (const auto &point: *points->second)
         {
-            out |= problems(bc::encode_hash(input.previous_output.hash));
-            if (doubleSpends_.count(input.previous_output))
-                out |= doubleSpent;
+            const auto entry = find(point.hash);
+            if (!entry || !entry->tx)
+                continue;
+
+            const auto &status = entry->status;
+            out.push_back(TxOutput
+            {
+                point, entry->tx->outputs[point.index].value,
+                !status.isDoubleSpent && !status.isReplaceByFee,
+                isIncoming(*entry->tx, status.height, addresses)
+            });
         }
-        return (visited_[txid] = out);
     }
 
-private:
-    const TxCache &cache_;
+    sortOutputs(out);
+    return out;
+}
 
-    PointSet spends_;
-    PointSet doubleSpends_;
-    std::map<std::string, unsigned> visited_;
-};
+const TxSnapshot::Entry *
+TxSnapshot::find(const bc::hash_digest &txid) const
+{
+    const auto &shard = shards_[txid[0]];
+    if (!shard)
+        return nullptr;
+    const auto i = shard->find(txid);
+    if (shard->end() == i)
+        return nullptr;
+    return &i->second;
+}
 
 struct CacheJson:
     public JsonObject
@@ -163,8 +186,10 @@ struct HeightJson:
 };
 
 
-TxCache::TxCache(BlockCache &blockCache):
-    blocks_(blockCache)
+TxCache::TxCache(BlockCache &blockCache, TxStore &txStore):
+    blocks_(blockCache),
+    store_(txStore),
+    snapshot_(std::make_shared<TxSnapshot>())
 {
 }
 
@@ -174,6 +199,18 @@ TxCache::clear()
     std::lock_guard<std::mutex> lock(mutex_);
     txs_.clear();
     heights_.clear();
+    spends_.clear();
+    problems_.clear();
+    unspent_.clear();
+    unconfirmed_.clear();
+    infos_.clear();
+    journalTxs_.clear();
+    journalHeights_.clear();
+    snapshotTxids_.clear();
+    snapshotAddresses_.clear();
+    std::atomic_store(&snapshot_,
+                      std::shared_ptr<const TxSnapshot>(
+                          std::make_shared<TxSnapshot>()));
 }
 
 Status
@@ -195,7 +232,13 @@ TxCache::load(JsonObject &json)
             bc::transaction_type tx;
             ABC_CHECK(decodeTx(tx, rawTx));
 
-            txs_[txJson.txid()] = std::move(tx);
+            bc::hash_digest txid;
+            if (!bc::decode_hash(txid, txJson.txid()))
+                return ABC_ERROR(ABC_CC_ParseError, "Bad txid");
+
+            if (!hashMatches(tx, txid, "cached"))
+                continue;
+            insertInternal(txid, store_.insert(tx));
         }
     }
 
@@ -205,65 +248,196 @@ TxCache::load(JsonObject &json)
     for (size_t i = 0; i < heightsSize; i++)
     {
         HeightJson heightJson(heightsJson[i]);
-        if (heightJson.txidOk())
+        bc::hash_digest txid;
+        if (heightJson.txidOk() && bc::decode_hash(txid, heightJson.txid()))
         {
             HeightInfo info;
             info.height = heightJson.height();
             info.firstSeen = heightJson.firstSeen();
-            heights_[heightJson.txid()] = info;
+            heights_[txid] = info;
+            unconfirmedUpdate(txid);
+            snapshotTouch(txid);
             blocks_.headerNeededAdd(info.height);
         }
     }
 
+    snapshotPublishInternal();
     return Status();
 }
 
 Status
-TxCache::save(JsonObject &json)
+TxCache::load(CacheReader &serial)
 {
     std::lock_guard<std::mutex> lock(mutex_);
-    CacheJson cacheJson(json);
 
-    // Tx data:
-    JsonArray txsJson;
-    for (const auto &tx: txs_)
+    // Tx data (anything missing from the store gets fetched again):
+    const auto txsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < txsSize; ++i)
     {
-        bc::data_chunk rawTx(satoshi_raw_size(tx.second));
-        bc::satoshi_save(tx.second, rawTx.begin());
-
-        TxJson txJson;
-        ABC_CHECK(txJson.txidSet(tx.first));
-        ABC_CHECK(txJson.dataSet(base64Encode(rawTx)));
-        ABC_CHECK(txsJson.append(txJson));
+        const auto txid = serial.read_hash();
+        if (const auto tx = store_.get(txid))
+            insertInternal(txid, tx);
     }
-    cacheJson.txsSet(txsJson);
 
     // Heights:
-    JsonArray heightsJson;
+    const auto heightsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < heightsSize; ++i)
+    {
+        const auto txid = serial.read_hash();
+        HeightInfo info;
+        info.height = serial.read_8_bytes();
+        info.firstSeen = serial.read_8_bytes();
+        heights_[txid] = info;
+        unconfirmedUpdate(txid);
+        snapshotTouch(txid);
+        blocks_.headerNeededAdd(info.height);
+    }
+
+    snapshotPublishInternal();
+    return Status();
+}
+
+void
+TxCache::save(CacheWriter &serial)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Txids, since the store holds the actual data:
+    serial.write_variable_uint(txs_.size());
+    for (const auto &tx: txs_)
+        serial.write_hash(tx.first);
+
+    // Heights, as fixed-width records:
+    serial.write_variable_uint(heights_.size());
     for (const auto &height: heights_)
     {
-        HeightJson heightJson;
-        ABC_CHECK(heightJson.txidSet(height.first));
-        if (height.second.height)
-            ABC_CHECK(heightJson.heightSet(height.second.height));
-        ABC_CHECK(heightJson.firstSeenSet(height.second.firstSeen));
-        ABC_CHECK(heightsJson.append(heightJson));
+        serial.write_hash(height.first);
+        serial.write_8_bytes(height.second.height);
+        serial.write_8_bytes(height.second.firstSeen);
     }
-    cacheJson.heightsSet(heightsJson);
 
+    // Everything is in the snapshot now:
+    journalTxs_.clear();
+    journalHeights_.clear();
+}
+
+bool
+TxCache::journalSave(CacheWriter &serial)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Inserted or dropped transactions:
+    serial.write_variable_uint(journalTxs_.size());
+    for (const auto &txid: journalTxs_)
+    {
+        serial.write_hash(txid);
+        serial.write_byte(txs_.count(txid));
+    }
+
+    // Changed heights (dropped ones go away with their transaction):
+    size_t heightsSize = 0;
+    for (const auto &txid: journalHeights_)
+        if (heights_.count(txid))
+            ++heightsSize;
+
+    serial.write_variable_uint(heightsSize);
+    for (const auto &txid: journalHeights_)
+    {
+        auto i = heights_.find(txid);
+        if (heights_.end() == i)
+            continue;
+
+        serial.write_hash(txid);
+        serial.write_8_bytes(i->second.height);
+        serial.write_8_bytes(i->second.firstSeen);
+    }
+
+    const bool out = !journalTxs_.empty() || !journalHeights_.empty();
+    journalTxs_.clear();
+    journalHeights_.clear();
+    return out;
+}
+
+Status
+TxCache::journalLoad(CacheReader &serial)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Inserted or dropped transactions:
+    const auto txsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < txsSize; ++i)
+    {
+        const auto txid = serial.read_hash();
+        if (serial.read_byte())
+        {
+            const auto tx = store_.get(txid);
+            if (tx && !txs_.count(txid))
+                insertInternal(txid, tx);
+        }
+        else
+        {
+            eraseInternal(txid);
+            heights_.erase(txid);
+            snapshotTouch(txid);
+        }
+    }
+
+    // Changed heights:
+    const auto heightsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < heightsSize; ++i)
+    {
+        const auto txid = serial.read_hash();
+        auto &info = heights_[txid];
+        const bool wasConfirmed = info.height;
+        info.height = serial.read_8_bytes();
+        info.firstSeen = serial.read_8_bytes();
+        unconfirmedUpdate(txid);
+        snapshotTouch(txid);
+        blocks_.headerNeededAdd(info.height);
+        if (wasConfirmed != !!info.height)
+            invalidate(txid);
+    }
+
+    snapshotPublishInternal();
     return Status();
 }
 
+void
+TxCache::txidsLoad(TxStore::Txids &result, CacheReader &serial)
+{
+    const auto txsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < txsSize; ++i)
+        result.insert(serial.read_hash());
+}
+
+void
+TxCache::txidsJournalLoad(TxStore::Txids &result, CacheReader &serial)
+{
+    const auto txsSize = serial.read_variable_uint();
+    for (uint64_t i = 0; i < txsSize; ++i)
+    {
+        const auto txid = serial.read_hash();
+        if (serial.read_byte())
+            result.insert(txid);
+        else
+            result.erase(txid);
+    }
+}
+
 Status
 TxCache::get(bc::transaction_type &result, const std::string &txid) const
 {
     std::lock_guard<std::mutex> lock(mutex_);
 
-    auto i = txs_.find(txid);
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return ABC_ERROR(ABC_CC_ParseError, "Bad txid " + txid);
+
+    auto i = txs_.find(hash);
     if (txs_.end() == i)
         return ABC_ERROR(ABC_CC_Synchronizing, "Cannot find transaction");
 
-    result = i->second;
+    result = *i->second.tx;
     return Status();
 }
 
@@ -271,39 +445,68 @@ Status
 TxCache::info(TxInfo &result, const bc::transaction_type &tx) const
 {
     std::lock_guard<std::mutex> lock(mutex_);
-    ABC_CHECK(infoInternal(result, tx));
+    ABC_CHECK(infoInternal(result, bc::hash_transaction(tx), tx));
     return Status();
 }
 
 Status
 TxCache::info(TxInfo &result, const std::string &txid) const
 {
-    bc::transaction_type tx;
-    ABC_CHECK(get(tx, txid));
-    ABC_CHECK(info(result, tx));
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return ABC_ERROR(ABC_CC_ParseError, "Bad txid " + txid);
+    auto i = txs_.find(hash);
+    if (txs_.end() == i)
+        return ABC_ERROR(ABC_CC_Synchronizing, "Cannot find transaction");
+
+    std::shared_ptr<const TxInfo> info;
+    ABC_CHECK(infoCached(info, hash, *i->second.tx));
+    result = *info;
     return Status();
 }
 
 Status
-TxCache::infoInternal(TxInfo &result, const bc::transaction_type &tx) const
+TxCache::infoCached(std::shared_ptr<const TxInfo> &result,
+                    const bc::hash_digest &txid,
+                    const bc::transaction_type &tx) const
+{
+    auto i = infos_.find(txid);
+    if (infos_.end() == i)
+    {
+        auto info = std::make_shared<TxInfo>();
+        ABC_CHECK(infoInternal(*info, txid, tx));
+        i = infos_.emplace(txid, std::move(info)).first;
+    }
+
+    result = i->second;
+    return Status();
+}
+
+Status
+TxCache::infoInternal(TxInfo &result, const bc::hash_digest &txid,
+                      const bc::transaction_type &tx) const
 {
     TxInfo out;
     int64_t totalIn = 0, totalOut = 0;
 
     // Basic info:
-    out.txid = bc::encode_hash(bc::hash_transaction(tx));
+    out.txid = bc::encode_hash(txid);
     out.ntxid = bc::encode_hash(makeNtxid(tx));
 
     // Scan inputs:
     for (const auto &input: tx.inputs)
     {
-        const auto txid = bc::encode_hash(input.previous_output.hash);
-        auto i = txs_.find(txid);
+        const auto &point = input.previous_output;
+        auto i = txs_.find(point.hash);
         if (txs_.end() == i)
-            return ABC_ERROR(ABC_CC_Synchronizing, "Missing input " + txid);
-        if (i->second.outputs.size() <= input.previous_output.index)
-            return ABC_ERROR(ABC_CC_Error, "Impossible input on " + txid);
-        auto &output = i->second.outputs[input.previous_output.index];
+            return ABC_ERROR(ABC_CC_Synchronizing,
+                             "Missing input " + bc::encode_hash(point.hash));
+        if (i->second.tx->outputs.size() <= point.index)
+            return ABC_ERROR(ABC_CC_Error,
+                             "Impossible input on " + bc::encode_hash(point.hash));
+        auto &output = i->second.tx->outputs[point.index];
 
         totalIn += output.value;
         bc::payment_address address;
@@ -331,18 +534,19 @@ TxCache::missing(const std::string &txid) const
 {
     std::lock_guard<std::mutex> lock(mutex_);
 
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return true;
+
     // Check the transaction:
-    auto i = txs_.find(txid);
+    auto i = txs_.find(hash);
     if (txs_.end() == i)
         return true;
 
     // Check the inputs:
-    for (const auto &input: i->second.inputs)
-    {
-        const auto txid = bc::encode_hash(input.previous_output.hash);
-        if (!txs_.count(txid))
+    for (const auto &input: i->second.tx->inputs)
+        if (!txs_.count(input.previous_output.hash))
             return true;
-    }
 
     return false;
 }
@@ -356,7 +560,8 @@ TxCache::missingTxids(const TxidSet &txids) const
     for (const auto &txid: txids)
     {
         // Check the transaction:
-        auto i = txs_.find(txid);
+        bc::hash_digest hash;
+        auto i = bc::decode_hash(hash, txid) ? txs_.find(hash) : txs_.end();
         if (txs_.end() == i)
         {
             out.insert(txid);
@@ -364,168 +569,485 @@ TxCache::missingTxids(const TxidSet &txids) const
         }
 
         // Check the inputs:
-        for (const auto &input: i->second.inputs)
-        {
-            const auto txid = bc::encode_hash(input.previous_output.hash);
-            if (!txs_.count(txid))
-                out.insert(txid);
-        }
+        for (const auto &input: i->second.tx->inputs)
+            if (!txs_.count(input.previous_output.hash))
+                out.insert(bc::encode_hash(input.previous_output.hash));
     }
 
     return out;
 }
 
-Status
-TxCache::status(TxStatus &result, const std::string &txid) const
-{
-    TxGraph graph(*this);
-    TxStatus out;
-    out.height = txidHeight(txid);
-    const auto problems = graph.problems(txid);
-    out.isDoubleSpent = problems & TxGraph::doubleSpent;
-    out.isReplaceByFee = problems & TxGraph::replaceByFee;
-
-    result = out;
-    return Status();
-}
-
-std::list<std::pair<TxInfo, TxStatus> >
-TxCache::statuses(const TxidSet &txids) const
+std::map<std::string, size_t>
+TxCache::heights(const TxidSet &txids) const
 {
     std::lock_guard<std::mutex> lock(mutex_);
-    std::list<std::pair<TxInfo, TxStatus>> out;
 
-    TxGraph graph(*this);
+    std::map<std::string, size_t> out;
     for (const auto &txid: txids)
     {
-        auto i = txs_.find(txid);
-        std::pair<TxInfo, TxStatus> pair;
-        if (txs_.end() != i && infoInternal(pair.first, i->second))
-        {
-            pair.second.height = txidHeight(i->first);
-            const auto problems = graph.problems(i->first);
-            pair.second.isDoubleSpent = problems & TxGraph::doubleSpent;
-            pair.second.isReplaceByFee = problems & TxGraph::replaceByFee;
-            out.push_back(pair);
-        }
+        bc::hash_digest hash;
+        if (!bc::decode_hash(hash, txid))
+            continue;
+
+        const auto i = heights_.find(hash);
+        if (heights_.end() != i)
+            out[txid] = i->second.height;
     }
+    return out;
+}
 
-    // TODO: Merge by ntxid
+TxidSet
+TxCache::unconfirmed() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
 
+    TxidSet out;
+    for (const auto &txid: unconfirmed_)
+        out.insert(bc::encode_hash(txid));
     return out;
 }
 
+Status
+TxCache::status(TxStatus &result, const std::string &txid) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return ABC_ERROR(ABC_CC_ParseError, "Bad txid " + txid);
+
+    result = statusInternal(hash);
+    return Status();
+}
+
+std::shared_ptr<const TxSnapshot>
+TxCache::snapshot() const
+{
+    return std::atomic_load(&snapshot_);
+}
+
 TxOutputList
 TxCache::utxos(const AddressSet &addresses) const
 {
     std::lock_guard<std::mutex> lock(mutex_);
 
-    // Build a list of spends:
-    TxGraph graph(*this);
-
-    // Check each output against the list:
     TxOutputList out;
-    for (auto &row: txs_)
+    for (const auto &address: addresses)
     {
-        for (uint32_t i = 0; i < row.second.outputs.size(); ++i)
+        auto points = unspent_.find(address);
+        if (unspent_.end() == points)
+            continue;
+
+        for (const auto &point: points->second)
         {
-            bc::hash_digest hash;
-            bc::decode_hash(hash, row.first);
-
-            bc::output_point point = {hash, i};
-            const auto &output = row.second.outputs[i];
-            bc::payment_address address;
-            const auto txid = row.first;
-
-            // The output is interesting if it isn't spent and belongs to us:
-            if (!graph.isSpent(point) &&
-                    bc::extract(address, output.script) &&
-                    addresses.count(address.encoded()))
+            const auto &row = txs_.find(point.hash)->second;
+            out.push_back(TxOutput
             {
-                out.push_back(TxOutput
-                {
-                    point, output.value,
-                    !graph.problems(row.first),
-                    isIncoming(row.second, txid, addresses)
-                });
-            }
+                point, row.tx->outputs[point.index].value,
+                !problems(point.hash),
+                isIncoming(*row.tx, txidHeight(point.hash), addresses)
+            });
         }
     }
 
+    sortOutputs(out);
     return out;
 }
 
+void
+TxCache::snapshotPublish()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshotPublishInternal();
+}
+
 bool
 TxCache::drop(const std::string &txid, time_t now)
 {
     std::unique_lock<std::mutex> lock(mutex_);
 
-    // Do not drop if it is confirmed or less than an hour old:
-    const auto &info = heights_[txid];
-    if (info.height || now < info.firstSeen + 60*60)
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return false;
+
+    // Do not drop if it is missing, confirmed, or less than an hour old:
+    const auto i = heights_.find(hash);
+    if (heights_.end() == i)
+        return false;
+    if (i->second.height || now < i->second.firstSeen + 60*60)
         return false;
 
-    heights_.erase(txid);
-    txs_.erase(txid);
+    // Other wallets might still have this transaction,
+    // so only our row goes away, and the shared store keeps its copy:
+    eraseInternal(hash);
+    heights_.erase(i);
+    journalTxs_.insert(hash);
+    snapshotTouch(hash);
     return true;
 }
 
+bool
+TxCache::hashMatches(const bc::transaction_type &tx,
+                     const bc::hash_digest &txid, const char *what)
+{
+    // The store keys by hash, so a mismatch would never load again:
+    if (bc::hash_transaction(tx) == txid)
+        return true;
+
+    ABC_DebugLog("Skipping %s transaction with bad txid %s",
+                 what, bc::encode_hash(txid).c_str());
+    return false;
+}
+
 bool
 TxCache::insert(const bc::transaction_type &tx, std::string txid)
 {
     std::unique_lock<std::mutex> lock(mutex_);
 
-    // Do not stomp existing tx's:
-    if (txid == "")
-        txid = bc::encode_hash(bc::hash_transaction(tx));
+    bc::hash_digest hash;
+    if (txid.empty())
+        hash = bc::hash_transaction(tx);
+    else if (!bc::decode_hash(hash, txid) || !hashMatches(tx, hash, "new"))
+        return false;
 
-    if (txs_.find(txid) == txs_.end())
+    // Do not stomp existing tx's:
+    if (txs_.find(hash) == txs_.end())
     {
-        txs_[txid] = tx;
+        insertInternal(hash, store_.insert(tx));
+        journalTxs_.insert(hash);
         return true;
     }
 
     return false;
 }
 
+bool
+TxCache::insertStored(const std::string &txid)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return false;
+    if (txs_.count(hash))
+        return true;
+
+    const auto tx = store_.get(hash);
+    if (!tx)
+        return false;
+
+    insertInternal(hash, tx);
+    journalTxs_.insert(hash);
+    return true;
+}
+
 void
 TxCache::confirmed(const std::string &txid, size_t height, time_t now)
 {
     std::lock_guard<std::mutex> lock(mutex_);
 
-    auto &info = heights_[txid];
+    bc::hash_digest hash;
+    if (!bc::decode_hash(hash, txid))
+        return;
+
+    auto &info = heights_[hash];
+    const bool wasConfirmed = info.height;
+    if (info.height != height || 0 == info.firstSeen)
+    {
+        journalHeights_.insert(hash);
+        snapshotTouch(hash);
+    }
     info.height = height;
+    unconfirmedUpdate(hash);
     blocks_.headerNeededAdd(height);
+
+    // Confirmed transactions are safe, so this changes our problem flags:
+    if (wasConfirmed != !!height)
+        invalidate(hash);
+
     if (0 == info.firstSeen)
         info.firstSeen = now;
 }
 
-bool
-TxCache::isIncoming(const bc::transaction_type &tx, const std::string &txid,
-                    const AddressSet &addresses) const
+size_t
+TxCache::txidHeight(const bc::hash_digest &txid) const
 {
-    // Confirmed transactions are no longer incoming:
-    if (txidHeight(txid))
-        return false;
+    const auto i = heights_.find(txid);
+    if (heights_.end() == i)
+        return 0;
+    return i->second.height;
+}
 
-    // This is a spend if we control all the inputs:
-    for (auto &input: tx.inputs)
+TxStatus
+TxCache::statusInternal(const bc::hash_digest &txid) const
+{
+    TxStatus out;
+    out.height = txidHeight(txid);
+    const auto flags = problems(txid);
+    out.isDoubleSpent = flags & doubleSpent;
+    out.isReplaceByFee = flags & replaceByFee;
+    return out;
+}
+
+void
+TxCache::insertInternal(const bc::hash_digest &txid, TxPointer shared)
+{
+    auto &row = txs_[txid];
+    row.tx = std::move(shared);
+    const auto &tx = *row.tx;
+    snapshotTouch(txid);
+
+    // Index our outputs by address:
+    row.addresses.resize(tx.outputs.size());
+    for (uint32_t i = 0; i < tx.outputs.size(); ++i)
     {
         bc::payment_address address;
-        if (!bc::extract(address, input.script) ||
-                !addresses.count(address.encoded()))
-            return true;
+        if (bc::extract(address, tx.outputs[i].script))
+            row.addresses[i] = address.encoded();
+
+        // Somebody might have spent this before we arrived:
+        const bc::point_type point{txid, i};
+        const auto spenders = spends_.find(point);
+        if (spends_.end() == spenders)
+            unspentInsert(point);
+        else
+            for (const auto &spender: spenders->second)
+            {
+                infos_.erase(spender);
+                snapshotTouch(spender);
+            }
     }
-    return false;
+
+    // The new transaction might double-spend somebody else's inputs:
+    for (const auto &input: tx.inputs)
+    {
+        auto &spenders = spends_[input.previous_output];
+        if (spenders.empty())
+            unspentErase(input.previous_output);
+        for (const auto &spender: spenders)
+            invalidate(spender);
+        spenders.insert(txid);
+    }
+
+    // We might have assumed this transaction was safe while it was missing:
+    invalidate(txid);
+    unconfirmedUpdate(txid);
 }
 
-size_t
-TxCache::txidHeight(const std::string &txid) const
+void
+TxCache::eraseInternal(const bc::hash_digest &txid)
 {
-    const auto i = heights_.find(txid);
-    if (heights_.end() == i)
-        return 0;
-    return i->second.height;
+    auto i = txs_.find(txid);
+    if (txs_.end() == i)
+        return;
+
+    // Our children lose their input, so clear them while we can find them:
+    invalidate(txid);
+
+    // Our outputs are going away:
+    infos_.erase(txid);
+    snapshotTouch(txid);
+    for (uint32_t index = 0; index < i->second.tx->outputs.size(); ++index)
+    {
+        const bc::point_type point{txid, index};
+        unspentErase(point);
+
+        const auto spenders = spends_.find(point);
+        if (spends_.end() != spenders)
+            for (const auto &spender: spenders->second)
+            {
+                infos_.erase(spender);
+                snapshotTouch(spender);
+            }
+    }
+
+    // Anybody we were double-spending with is now in the clear:
+    for (const auto &input: i->second.tx->inputs)
+    {
+        auto spenders = spends_.find(input.previous_output);
+        if (spends_.end() == spenders)
+            continue;
+
+        spenders->second.erase(txid);
+        for (const auto &spender: spenders->second)
+            invalidate(spender);
+        if (spenders->second.empty())
+        {
+            spends_.erase(spenders);
+            unspentInsert(input.previous_output);
+        }
+    }
+
+    txs_.erase(i);
+    unconfirmed_.erase(txid);
+}
+
+void
+TxCache::unspentInsert(const bc::point_type &point)
+{
+    auto i = txs_.find(point.hash);
+    if (txs_.end() == i || i->second.addresses.size() <= point.index)
+        return;
+
+    const auto &address = i->second.addresses[point.index];
+    if (!address.empty())
+    {
+        unspent_[address].insert(point);
+        snapshotAddresses_.insert(address);
+    }
+}
+
+void
+TxCache::unspentErase(const bc::point_type &point)
+{
+    auto i = txs_.find(point.hash);
+    if (txs_.end() == i || i->second.addresses.size() <= point.index)
+        return;
+
+    auto points = unspent_.find(i->second.addresses[point.index]);
+    if (unspent_.end() == points)
+        return;
+
+    snapshotAddresses_.insert(points->first);
+    points->second.erase(point);
+    if (points->second.empty())
+        unspent_.erase(points);
+}
+
+void
+TxCache::unconfirmedUpdate(const bc::hash_digest &txid)
+{
+    if (txs_.count(txid) && !txidHeight(txid))
+        unconfirmed_.insert(txid);
+    else
+        unconfirmed_.erase(txid);
+}
+
+unsigned
+TxCache::problems(const bc::hash_digest &txid) const
+{
+    // Just use the previous result if we have been here before:
+    auto pi = problems_.find(txid);
+    if (problems_.end() != pi)
+        return pi->second;
+
+    // We have to assume missing transactions are safe:
+    auto i = txs_.find(txid);
+    if (txs_.end() == i)
+        return (problems_[txid] = 0);
+
+    // Confirmed transactions are also safe:
+    if (txidHeight(txid))
+        return (problems_[txid] = 0);
+
+    // Check for the opt-in replace-by-fee flag:
+    unsigned out = 0;
+    if (isReplaceByFee(*i->second.tx))
+        out |= replaceByFee;
+
+    // Recursively check all the inputs:
+    for (const auto &input: i->second.tx->inputs)
+    {
+        out |= problems(input.previous_output.hash);
+        const auto spenders = spends_.find(input.previous_output);
+        if (spends_.end() != spenders && 1 < spenders->second.size())
+            out |= doubleSpent;
+    }
+    return (problems_[txid] = out);
+}
+
+void
+TxCache::invalidate(const bc::hash_digest &txid)
+{
+    // Missing transactions are always assumed safe, so nothing changes:
+    auto i = txs_.find(txid);
+    if (txs_.end() == i)
+        return;
+
+    // Memoized results always have memoized inputs,
+    // so if this entry is gone, nothing downstream is cached either:
+    if (!problems_.erase(txid))
+        return;
+    snapshotTouch(txid);
+
+    for (uint32_t index = 0; index < i->second.tx->outputs.size(); ++index)
+    {
+        const auto spenders = spends_.find(bc::point_type{txid, index});
+        if (spends_.end() == spenders)
+            continue;
+
+        for (const auto &spender: spenders->second)
+            invalidate(spender);
+    }
+}
+
+void
+TxCache::snapshotTouch(const bc::hash_digest &txid)
+{
+    snapshotTxids_.insert(txid);
+}
+
+void
+TxCache::snapshotPublishInternal()
+{
+    if (snapshotTxids_.empty() && snapshotAddresses_.empty())
+        return;
+    const auto old = std::atomic_load(&snapshot_);
+
+    // Share the untouched shards, and copy the touched ones once:
+    auto out = std::make_shared<TxSnapshot>(*old);
+    std::array<std::shared_ptr<TxSnapshot::Shard>, 256> copies;
+    for (const auto &txid: snapshotTxids_)
+    {
+        auto &shard = copies[txid[0]];
+        if (!shard)
+        {
+            const auto &oldShard = old->shards_[txid[0]];
+            shard = oldShard ?
+                    std::make_shared<TxSnapshot::Shard>(*oldShard) :
+                    std::make_shared<TxSnapshot::Shard>();
+            out->shards_[txid[0]] = shard;
+        }
+
+        const auto i = txs_.find(txid);
+        if (txs_.end() == i && !heights_.count(txid))
+        {
+            shard->erase(txid);
+            continue;
+        }
+
+        auto &entry = (*shard)[txid];
+        entry.status = statusInternal(txid);
+        entry.tx.reset();
+        entry.info.reset();
+        if (txs_.end() != i)
+        {
+            entry.tx = i->second.tx;
+            infoCached(entry.info, txid, *i->second.tx);
+        }
+    }
+
+    // Likewise, only copy the unspent sets that changed:
+    if (!snapshotAddresses_.empty())
+    {
+        auto unspent = old->unspent_ ?
+                       std::make_shared<TxSnapshot::Unspent>(*old->unspent_) :
+                       std::make_shared<TxSnapshot::Unspent>();
+        for (const auto &address: snapshotAddresses_)
+        {
+            const auto i = unspent_.find(address);
+            if (unspent_.end() == i)
+                unspent->erase(address);
+            else
+                (*unspent)[address] =
+                    std::make_shared<const TxSnapshot::Points>(i->second);
+        }
+        out->unspent_ = unspent;
+    }
+
+    snapshotTxids_.clear();
+    snapshotAddresses_.clear();
+    std::atomic_store(&snapshot_, std::shared_ptr<const TxSnapshot>(out));
 }
 
 } // namespace abcd
@@ -8,10 +8,40 @@
 #ifndef ABCD_BITCOIN_CACHE_TX_CACHE_HPP
 #define ABCD_BITCOIN_CACHE_TX_CACHE_HPP
 
+#include "TxStore.hpp"
 #include "../Typedefs.hpp"
+#include "../Utility.hpp"
 #include <bitcoin/bitcoin.hpp>
+#include <array>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace std {
+
+/**
+ * Allows `bc::point_type` to be used with `std::unordered_map`.
+ */
+template<> struct hash<bc::point_type>
+{
+    typedef bc::point_type argument_type;
+    typedef std::size_t result_type;
+
+    result_type
+    operator()(argument_type const &p) const
+    {
+        auto h = libbitcoin::from_little_endian_unsafe<result_type>(
+                     p.hash.begin());
+        return h ^ p.index;
+    }
+};
+
+} // namespace std
 
 namespace abcd {
 
@@ -69,6 +99,70 @@ typedef std::list<TxOutput> TxOutputList;
 libbitcoin::output_info_list
 filterOutputs(const TxOutputList &utxos, bool filter=false);
 
+/**
+ * A consistent, read-only view of a `TxCache`.
+ *
+ * The watcher publishes a new snapshot after each batch of updates,
+ * so GUI threads can hold on to one and make several queries
+ * without blocking the watcher thread or seeing the data change mid-way.
+ */
+class TxSnapshot
+{
+public:
+    /**
+     * Looks up a transaction and returns its input & output information.
+     */
+    Status
+    info(TxInfo &result, const std::string &txid) const;
+
+    /**
+     * Looks up a transaction and returns its confirmation & safety state.
+     */
+    Status
+    status(TxStatus &result, const std::string &txid) const;
+
+    /**
+     * Lists all the transactions relevant to these addresses,
+     * along with their information. Skips missing txids.
+     * Each txid gets its own entry, so malleated copies of a transaction
+     * show up separately, with the same ntxid.
+     */
+    std::list<std::pair<TxInfo, TxStatus> >
+    statuses(const TxidSet &txids) const;
+
+    /**
+     * Get just the utxos corresponding to a set of addresses.
+     * This uses an index, so it only touches the requested addresses.
+     */
+    TxOutputList
+    utxos(const AddressSet &addresses) const;
+
+private:
+    friend class TxCache;
+
+    struct Entry
+    {
+        TxPointer tx; // Null if we only know the height
+        std::shared_ptr<const TxInfo> info; // Null if inputs are missing
+        TxStatus status;
+    };
+    typedef std::unordered_map<bc::hash_digest, Entry, HashDigestHash> Shard;
+
+    // The entries are split up by the first txid byte,
+    // so a new snapshot only needs to copy the shards that changed:
+    std::array<std::shared_ptr<const Shard>, 256> shards_;
+
+    // The unspent outputs for each address,
+    // with each address's set shared until it changes:
+    typedef std::unordered_set<bc::point_type> Points;
+    typedef std::unordered_map<std::string, std::shared_ptr<const Points>>
+            Unspent;
+    std::shared_ptr<const Unspent> unspent_;
+
+    const Entry *
+    find(const bc::hash_digest &txid) const;
+};
+
 /**
  * A list of transactions.
  *
@@ -84,7 +178,7 @@ class TxCache
 public:
     // Lifetime -----------------------------------------------------------
 
-    TxCache(BlockCache &blockCache);
+    TxCache(BlockCache &blockCache, TxStore &txStore);
 
     /**
      * Clears the database for debugging purposes.
@@ -99,10 +193,46 @@ public:
     load(JsonObject &json);
 
     /**
-     * Saves the database contents to the provided cache JSON object.
+     * Reads the database contents from a binary cache file.
+     * The transactions themselves come from the shared store.
+     */
+    Status
+    load(CacheReader &serial);
+
+    /**
+     * Writes the database contents to a binary cache file.
+     * Only the txids go in the file, since the store holds the rest.
+     * This also empties the journal.
+     */
+    void
+    save(CacheWriter &serial);
+
+    /**
+     * Writes the transactions and heights that have changed since
+     * the last `save` or `journalSave` as a journal entry.
+     * @return false if nothing has changed.
+     */
+    bool
+    journalSave(CacheWriter &serial);
+
+    /**
+     * Replays a journal entry written by `journalSave`.
      */
     Status
-    save(JsonObject &json);
+    journalLoad(CacheReader &serial);
+
+    /**
+     * Adds the txids from a binary cache file to the set,
+     * without touching the store.
+     */
+    static void
+    txidsLoad(TxStore::Txids &result, CacheReader &serial);
+
+    /**
+     * Applies the inserted & dropped txids from a journal entry to the set.
+     */
+    static void
+    txidsJournalLoad(TxStore::Txids &result, CacheReader &serial);
 
     // Queries ------------------------------------------------------------
 
@@ -139,6 +269,21 @@ public:
     TxidSet
     missingTxids(const TxidSet &txids) const;
 
+    /**
+     * Looks up the block heights of these transactions,
+     * with zero for unconfirmed ones.
+     * Transactions the cache has never heard of are left out.
+     */
+    std::map<std::string, size_t>
+    heights(const TxidSet &txids) const;
+
+    /**
+     * Lists the transactions in the cache that haven't confirmed yet.
+     * This uses an index, so it doesn't touch the confirmed ones.
+     */
+    TxidSet
+    unconfirmed() const;
+
     /**
      * Looks up a transaction and returns its confirmation & safety state.
      */
@@ -146,20 +291,28 @@ public:
     status(TxStatus &result, const std::string &txid) const;
 
     /**
-     * Lists all the transactions relevant to these addresses,
-     * along with their information. Skips missing txids.
+     * Returns the most recently published view of the cache.
+     * This is lock-free, so GUI threads never wait on the watcher.
      */
-    std::list<std::pair<TxInfo, TxStatus> >
-    statuses(const TxidSet &txids) const;
+    std::shared_ptr<const TxSnapshot>
+    snapshot() const;
 
     /**
      * Get just the utxos corresponding to a set of addresses.
+     * This uses an index, so it only touches the requested addresses.
      */
     TxOutputList
     utxos(const AddressSet &addresses) const;
 
     // Updates ------------------------------------------------------------
 
+    /**
+     * Publishes a new snapshot with any changes since the last one.
+     * The watcher calls this after each batch of updates.
+     */
+    void
+    snapshotPublish();
+
     /**
      * Removes a transaction from the cache if it is old and unconfirmed.
      * @return true if the transaction was removed.
@@ -167,13 +320,31 @@ public:
     bool
     drop(const std::string &txid, time_t now=time(nullptr));
 
+    /**
+     * Returns true if the transaction hashes to this txid,
+     * logging a message otherwise.
+     * @param what Describes where the transaction came from, for the log.
+     */
+    static bool
+    hashMatches(const bc::transaction_type &tx, const bc::hash_digest &txid,
+                const char *what);
+
     /**
      * Insert a new transaction into the database.
+     * The transaction is rejected if the txid doesn't match its hash.
      * @return true if the callback should be fired.
      */
     bool
     insert(const bc::transaction_type &tx, std::string txid="");
 
+    /**
+     * Inserts a transaction from the shared store,
+     * in case another wallet has already fetched it.
+     * @return true if the transaction is now in the database.
+     */
+    bool
+    insertStored(const std::string &txid);
+
     /**
      * Mark a transaction as confirmed.
      * TODO: Require the block hash as well, once obelisk provides this.
@@ -182,7 +353,8 @@ public:
     confirmed(const std::string &txid, size_t height, time_t now=time(nullptr));
 
 private:
-    friend class TxGraph;
+    static constexpr unsigned doubleSpent = 1 << 0;
+    static constexpr unsigned replaceByFee = 1 << 1;
 
     struct HeightInfo
     {
@@ -190,29 +362,152 @@ private:
         time_t firstSeen = 0;
     };
 
+    struct TxRow
+    {
+        TxPointer tx; // Shared with the other wallets
+        std::vector<std::string> addresses; // Per output, blank if unknown
+    };
+
+    // Everything is keyed by binary txid.
+    // Hex strings only appear at the public API boundary.
+    template<typename T> using TxidMap =
+        std::unordered_map<bc::hash_digest, T, HashDigestHash>;
+
     mutable std::mutex mutex_;
-    std::map<std::string, bc::transaction_type> txs_;
-    std::map<std::string, HeightInfo> heights_;
+    TxidMap<TxRow> txs_;
+    TxidMap<HeightInfo> heights_;
     BlockCache &blocks_;
+    TxStore &store_;
+
+    /**
+     * Maps each output point to the transactions that spend it.
+     * A point with more than one spender has been double-spent.
+     */
+    std::unordered_map<bc::point_type, std::set<bc::hash_digest>> spends_;
+
+    /**
+     * Memoized problem flags, filled in lazily by `problems`.
+     * Whenever the graph changes, `invalidate` removes the entries
+     * for the affected transaction and everything downstream of it.
+     */
+    mutable TxidMap<unsigned> problems_;
+
+    /**
+     * Maps each address to its unspent outputs.
+     */
+    std::unordered_map<std::string, std::unordered_set<bc::point_type>>
+            unspent_;
 
     /**
-     * Same as `txInfo`, but should be called with the mutex held.
+     * Transactions in the cache without a block height.
+     */
+    std::unordered_set<bc::hash_digest, HashDigestHash> unconfirmed_;
+
+    /**
+     * Memoized transaction info, filled in lazily by `infoCached`.
+     * An entry only goes stale when one of its inputs arrives or leaves.
+     */
+    mutable TxidMap<std::shared_ptr<const TxInfo>> infos_;
+
+    /**
+     * The most recently published snapshot, which must be accessed
+     * with `std::atomic_load` and `std::atomic_store`.
+     * The sets hold the transactions and addresses that have changed since.
+     */
+    std::shared_ptr<const TxSnapshot> snapshot_;
+    std::unordered_set<bc::hash_digest, HashDigestHash> snapshotTxids_;
+    std::unordered_set<std::string> snapshotAddresses_;
+
+    /**
+     * Transactions and heights that have changed since the last save.
+     */
+    std::unordered_set<bc::hash_digest, HashDigestHash> journalTxs_;
+    std::unordered_set<bc::hash_digest, HashDigestHash> journalHeights_;
+
+    /**
+     * Same as `info`, but should be called with the mutex held.
      */
     Status
-    infoInternal(TxInfo &result, const bc::transaction_type &tx) const;
+    infoInternal(TxInfo &result, const bc::hash_digest &txid,
+                 const bc::transaction_type &tx) const;
 
     /**
-     * Returns true if the transaction has incoming non-change funds.
+     * Same as `infoInternal`, but memoizes the result
+     * for transactions that live in the cache.
      */
-    bool
-    isIncoming(const bc::transaction_type &tx, const std::string &txid,
-               const AddressSet &addresses) const;
+    Status
+    infoCached(std::shared_ptr<const TxInfo> &result,
+               const bc::hash_digest &txid,
+               const bc::transaction_type &tx) const;
+
+    /**
+     * Same as `status`, but should be called with the mutex held.
+     */
+    TxStatus
+    statusInternal(const bc::hash_digest &txid) const;
+
+    /**
+     * Marks a transaction as changed for the next snapshot.
+     */
+    void
+    snapshotTouch(const bc::hash_digest &txid);
+
+    /**
+     * Same as `snapshotPublish`, but should be called with the mutex held.
+     */
+    void
+    snapshotPublishInternal();
 
     /**
      * Returns a transaction's height, or zero if it is unconfirmed.
      */
     size_t
-    txidHeight(const std::string &txid) const;
+    txidHeight(const bc::hash_digest &txid) const;
+
+    /**
+     * Adds a transaction to the cache and the spend index.
+     */
+    void
+    insertInternal(const bc::hash_digest &txid, TxPointer shared);
+
+    /**
+     * Removes a transaction from the cache and the spend index.
+     */
+    void
+    eraseInternal(const bc::hash_digest &txid);
+
+    /**
+     * Adds an output to the unspent index, if we know its address.
+     */
+    void
+    unspentInsert(const bc::point_type &point);
+
+    /**
+     * Removes an output from the unspent index.
+     */
+    void
+    unspentErase(const bc::point_type &point);
+
+    /**
+     * Brings the transaction's entry in the unconfirmed index up to date.
+     * Call this after changing its row or its height.
+     */
+    void
+    unconfirmedUpdate(const bc::hash_digest &txid);
+
+    /**
+     * Recursively checks the transaction graph for problems.
+     * @return A bitfield containing problem flags.
+     */
+    unsigned
+    problems(const bc::hash_digest &txid) const;
+
+    /**
+     * Discards the memoized problem flags for a transaction
+     * and all the transactions that spend from it.
+     */
+    void
+    invalidate(const bc::hash_digest &txid);
 };
 
 } // namespace abcd
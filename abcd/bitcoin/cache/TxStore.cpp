@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2016, Airbitz, Inc.
+ * All rights reserved.
+ *
+ * See the LICENSE file for more information.
+ */
+
+#include "TxStore.hpp"
+#include "../Typedefs.hpp"
+#include "../../util/Debug.hpp"
+#include "../../util/FileIO.hpp"
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace abcd {
+
+/**
+ * The store file is a header followed by append-only entries:
+ *
+ *  magic  4 bytes
+ *
+ * with each entry being:
+ *
+ *  size   4 bytes
+ *  crc    4 bytes, the CRC-32 of the entry data
+ *  data   the txid, then the raw transaction
+ */
+constexpr uint32_t txStoreMagic = 0xabcd7c00;
+constexpr size_t txStoreHeaderSize = 4;
+constexpr size_t txStoreEntryHeaderSize = 4 + 4;
+
+static DataChunk
+entryData(const bc::hash_digest &txid, const bc::transaction_type &tx)
+{
+    DataChunk out(txid.size() + satoshi_raw_size(tx));
+    std::copy(txid.begin(), txid.end(), out.begin());
+    bc::satoshi_save(tx, out.begin() + txid.size());
+    return out;
+}
+
+static void
+entrySave(DataChunk &out, DataSlice data)
+{
+    DataChunk header(txStoreEntryHeaderSize);
+    auto serial = bc::make_serializer(header.begin());
+    serial.write_4_bytes(data.size());
+    serial.write_4_bytes(crc32(0, data.data(), data.size()));
+    out.insert(out.end(), header.begin(), header.end());
+    out.insert(out.end(), data.begin(), data.end());
+}
+
+TxStore::~TxStore()
+{
+    if (0 <= fd_)
+        close(fd_);
+}
+
+TxStore::TxStore(const std::string &path,
+                 const ReferencesCallback &references):
+    path_(path),
+    references_(references)
+{
+}
+
+Status
+TxStore::save()
+{
+    bool sweeping;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!loaded_)
+            return Status(); // Nobody has touched the store
+
+        sweeping = references_ && !swept_;
+        swept_ = true;
+    }
+
+    // Reading the wallet caches is slow, so do it outside the lock.
+    // If a wallet saves in the meantime, the store might drop
+    // something it still wants, which just gets fetched again:
+    Txids referenced;
+    if (sweeping)
+        sweeping = references_(referenced).log();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sweeping)
+        sweep(referenced);
+
+    // Start over if the file is bad or mostly garbage:
+    const auto liveSize = fileSize_ -
+                          std::min(fileSize_, txStoreHeaderSize + deadSize_);
+    if (!fileOk_ || liveSize < deadSize_)
+        return rewrite();
+    if (unsaved_.empty())
+        return Status();
+
+    // Append the new transactions:
+    DataChunk out;
+    std::vector<Entry> saved;
+    for (const auto &tx: unsaved_)
+    {
+        const auto data = entryData(tx.first, *tx.second);
+        Entry entry;
+        entry.offset = fileSize_ + out.size() + txStoreEntryHeaderSize;
+        entry.size = data.size();
+        saved.push_back(entry);
+        entrySave(out, data);
+    }
+
+    ABC_CHECK(fileAppendOrSave(fileOk_, out, path_));
+    fileSize_ += out.size();
+
+    for (size_t i = 0; i < unsaved_.size(); ++i)
+    {
+        auto &entry = entries_[unsaved_[i].first];
+        entry.offset = saved[i].offset;
+        entry.size = saved[i].size;
+    }
+    unsaved_.clear();
+
+    return Status();
+}
+
+TxPointer
+TxStore::get(const bc::hash_digest &txid)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    loadInternal().log();
+
+    auto i = entries_.find(txid);
+    if (entries_.end() == i)
+        return TxPointer();
+    auto out = i->second.tx.lock();
+    if (out)
+        return out;
+
+    // A read error might go away, so keep the entry for next time:
+    DataChunk data;
+    const auto s = read(data, i->second).log();
+    if (!s && ABC_CC_ParseError != s.value())
+        return TxPointer();
+
+    // Decode the transaction, making sure it is what it claims to be:
+    bc::transaction_type tx;
+    if (!s ||
+            !decodeTx(tx, bc::data_slice(data.data() + txid.size(),
+                                         data.data() + data.size())).log() ||
+            bc::hash_transaction(tx) != txid)
+    {
+        ABC_DebugLog("Dropping bad transaction store entry %s",
+                     bc::encode_hash(txid).c_str());
+        deadSize_ += txStoreEntryHeaderSize + i->second.size;
+        entries_.erase(i);
+        return TxPointer();
+    }
+
+    out = std::make_shared<const bc::transaction_type>(std::move(tx));
+    i->second.tx = out;
+    return out;
+}
+
+TxPointer
+TxStore::insert(const bc::transaction_type &tx)
+{
+    // Every wallet trusts this copy, so never take a txid on faith:
+    const auto txid = bc::hash_transaction(tx);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    loadInternal().log();
+
+    auto &entry = entries_[txid];
+    auto out = entry.tx.lock();
+    if (!out)
+    {
+        out = std::make_shared<const bc::transaction_type>(tx);
+        entry.tx = out;
+        if (!entry.offset)
+            unsaved_.push_back(std::make_pair(txid, out));
+    }
+    return out;
+}
+
+Status
+TxStore::loadInternal()
+{
+    if (loaded_)
+        return Status();
+    loaded_ = true;
+
+    fd_ = open(path_.c_str(), O_RDONLY);
+    if (fd_ < 0)
+        return ABC_ERROR(ABC_CC_FileOpenError, "Cannot open " + path_);
+    struct stat info;
+    if (fstat(fd_, &info) < 0)
+        return ABC_ERROR(ABC_CC_FileReadError, "Cannot read " + path_);
+    const size_t fileSize = info.st_size;
+
+    // Header:
+    uint8_t header[txStoreHeaderSize];
+    if (static_cast<ssize_t>(sizeof(header)) !=
+            pread(fd_, header, sizeof(header), 0))
+        return ABC_ERROR(ABC_CC_ParseError, "Truncated transaction store");
+    auto serial = bc::make_deserializer(header, header + sizeof(header));
+    if (txStoreMagic != serial.read_4_bytes())
+        return ABC_ERROR(ABC_CC_ParseError, "Unknown transaction store header");
+    size_t offset = txStoreHeaderSize;
+
+    // Index the entries from their headers alone,
+    // leaving the CRC check and decoding for later:
+    while (offset < fileSize)
+    {
+        uint8_t buffer[txStoreEntryHeaderSize + sizeof(bc::hash_digest)];
+        if (fileSize - offset < sizeof(buffer) ||
+                static_cast<ssize_t>(sizeof(buffer)) !=
+                pread(fd_, buffer, sizeof(buffer), offset))
+            return ABC_ERROR(ABC_CC_ParseError, "Torn transaction store entry");
+
+        auto reader = bc::make_deserializer(buffer, buffer + sizeof(buffer));
+        const size_t size = reader.read_4_bytes();
+        (void)reader.read_4_bytes(); // CRC
+        if (fileSize - offset - txStoreEntryHeaderSize < size ||
+                size < sizeof(bc::hash_digest))
+            return ABC_ERROR(ABC_CC_ParseError, "Torn transaction store entry");
+
+        auto &entry = entries_[reader.read_hash()];
+        if (entry.offset)
+        {
+            deadSize_ += txStoreEntryHeaderSize + size;
+        }
+        else
+        {
+            entry.offset = offset + txStoreEntryHeaderSize;
+            entry.size = size;
+        }
+
+        offset += txStoreEntryHeaderSize + size;
+    }
+
+    fileSize_ = fileSize;
+    fileOk_ = true;
+    return Status();
+}
+
+void
+TxStore::sweep(const Txids &referenced)
+{
+    auto i = entries_.begin();
+    while (entries_.end() != i)
+    {
+        if (referenced.count(i->first) || !i->second.tx.expired())
+        {
+            ++i;
+            continue;
+        }
+
+        if (i->second.offset)
+            deadSize_ += txStoreEntryHeaderSize + i->second.size;
+        i = entries_.erase(i);
+    }
+}
+
+Status
+TxStore::read(DataChunk &result, const Entry &entry)
+{
+    DataChunk buffer(txStoreEntryHeaderSize + entry.size);
+    if (fd_ < 0 || static_cast<ssize_t>(buffer.size()) !=
+            pread(fd_, buffer.data(), buffer.size(),
+                  entry.offset - txStoreEntryHeaderSize))
+        return ABC_ERROR(ABC_CC_FileReadError, "Cannot read " + path_);
+
+    auto serial = bc::make_deserializer(buffer.data(),
+                                        buffer.data() + buffer.size());
+    (void)serial.read_4_bytes(); // Size
+    const uint32_t crc = serial.read_4_bytes();
+    const uint8_t *begin = serial.iterator();
+    if (crc != crc32(0, begin, entry.size))
+        return ABC_ERROR(ABC_CC_ParseError, "Corrupt transaction store entry");
+
+    result.assign(begin, begin + entry.size);
+    return Status();
+}
+
+Status
+TxStore::rewrite()
+{
+    DataChunk out(txStoreHeaderSize);
+    auto serial = bc::make_serializer(out.begin());
+    serial.write_4_bytes(txStoreMagic);
+
+    // Copy the live entries, without decoding the ones on disk:
+    decltype(entries_) entries;
+    for (const auto &i: entries_)
+    {
+        DataChunk data;
+        if (i.second.offset)
+        {
+            // Only leave out corrupt entries, not ones we failed to read:
+            const auto s = read(data, i.second).log();
+            if (!s && ABC_CC_ParseError != s.value())
+                return s;
+            if (!s)
+                continue;
+        }
+        else if (const auto tx = i.second.tx.lock())
+        {
+            data = entryData(i.first, *tx);
+        }
+        else
+        {
+            continue;
+        }
+
+        auto &entry = entries[i.first];
+        entry.offset = out.size() + txStoreEntryHeaderSize;
+        entry.size = data.size();
+        entry.tx = i.second.tx;
+        entrySave(out, data);
+    }
+
+    fileOk_ = false;
+    ABC_CHECK(fileSave(out, path_));
+
+    // The old file is still open, so keep reading from it
+    // until the new one opens, and try again next time otherwise:
+    const int fd = open(path_.c_str(), O_RDONLY);
+    if (fd < 0)
+        return ABC_ERROR(ABC_CC_FileOpenError, "Cannot open " + path_);
+    if (0 <= fd_)
+        close(fd_);
+    fd_ = fd;
+
+    entries_.swap(entries);
+    unsaved_.clear();
+    fileSize_ = out.size();
+    deadSize_ = 0;
+    fileOk_ = true;
+
+    return Status();
+}
+
+} // namespace abcd
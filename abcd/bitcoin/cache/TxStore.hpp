@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2016, Airbitz, Inc.
+ * All rights reserved.
+ *
+ * See the LICENSE file for more information.
+ */
+
+#ifndef ABCD_BITCOIN_CACHE_TX_STORE_HPP
+#define ABCD_BITCOIN_CACHE_TX_STORE_HPP
+
+#include "../Utility.hpp"
+#include "../../util/Data.hpp"
+#include "../../util/Status.hpp"
+#include <bitcoin/bitcoin.hpp>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace abcd {
+
+/**
+ * A transaction shared between all the wallets that use it.
+ */
+typedef std::shared_ptr<const bc::transaction_type> TxPointer;
+
+/**
+ * An app-wide, content-addressed transaction store.
+ *
+ * Transactions never change once they have a txid,
+ * so every wallet on the device can share the same decoded copy.
+ * The wallet caches only hold their own txid & height views on top.
+ *
+ * The file is only indexed up front, by reading each entry's header,
+ * and each transaction is decoded the first time a wallet asks for it.
+ * Once no wallet holds a copy, the memory goes away,
+ * and the next `get` reads it off disk again.
+ *
+ * Once per session, the store drops the transactions that no wallet
+ * uses any more, such as double-spends or those of deleted wallets.
+ */
+class TxStore
+{
+public:
+    typedef std::unordered_set<bc::hash_digest, HashDigestHash> Txids;
+
+    /**
+     * Lists the transactions that the wallet caches on disk refer to.
+     */
+    typedef std::function<Status (Txids &result)> ReferencesCallback;
+
+    ~TxStore();
+
+    /**
+     * @param references Finds the transactions worth keeping,
+     * or null to keep everything.
+     */
+    TxStore(const std::string &path,
+            const ReferencesCallback &references=nullptr);
+
+    /**
+     * Writes any new transactions to disk.
+     * Rewrites the whole file instead once dead entries pile up.
+     * The first save each session also sweeps out unused transactions.
+     */
+    Status
+    save();
+
+    /**
+     * Looks up a transaction, returning null if the store doesn't have it.
+     */
+    TxPointer
+    get(const bc::hash_digest &txid);
+
+    /**
+     * Adds a transaction to the store under its own hash,
+     * returning the shared copy.
+     * If the store already has this transaction, the existing copy wins.
+     */
+    TxPointer
+    insert(const bc::transaction_type &tx);
+
+    TxStore(const TxStore &copy) = delete;
+    TxStore &operator=(const TxStore &copy) = delete;
+
+private:
+    struct Entry
+    {
+        size_t offset = 0; // Start of the entry data, or 0 if unsaved
+        size_t size = 0;
+        std::weak_ptr<const bc::transaction_type> tx;
+    };
+
+    std::mutex mutex_;
+    const std::string path_;
+    const ReferencesCallback references_;
+    bool swept_ = false;
+    std::unordered_map<bc::hash_digest, Entry, HashDigestHash> entries_;
+
+    // File state:
+    bool loaded_ = false;
+    int fd_ = -1;
+    size_t fileSize_ = 0;
+    size_t deadSize_ = 0; // Bytes taken by dead or corrupt entries
+    bool fileOk_ = false; // False if the next save needs to rewrite the file
+
+    // New transactions, held in memory until they reach the disk:
+    std::vector<std::pair<bc::hash_digest, TxPointer>> unsaved_;
+
+    /**
+     * Indexes the file the first time anybody uses the store.
+     */
+    Status
+    loadInternal();
+
+    /**
+     * Drops the entries that are neither referenced nor in memory,
+     * so the next rewrite leaves them out.
+     */
+    void
+    sweep(const Txids &referenced);
+
+    /**
+     * Reads an entry's data back off disk, checking its CRC.
+     * A corrupt entry fails with `ABC_CC_ParseError`,
+     * while anything else is an I/O error that might go away.
+     */
+    Status
+    read(DataChunk &result, const Entry &entry);
+
+    /**
+     * Writes a fresh file holding only the live entries.
+     */
+    Status
+    rewrite();
+};
+
+} // namespace abcd
+
+#endif
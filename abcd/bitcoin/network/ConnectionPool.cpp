@@ -0,0 +1,945 @@
+/*
+ * Copyright (c) 2016, Airbitz, Inc.
+ * All rights reserved.
+ *
+ * See the LICENSE file for more information.
+ */
+
+#include "ConnectionPool.hpp"
+#include "LibbitcoinConnection.hpp"
+#include "StratumConnection.hpp"
+#include "TxUpdater.hpp"
+#include "../cache/BlockCache.hpp"
+#include "../cache/Cache.hpp"
+#include "../../General.hpp"
+#include "../../util/Debug.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace abcd {
+
+constexpr auto NUM_CONNECT_SERVERS = 5;
+constexpr auto MINIMUM_AIRBITZ_SERVERS = 1;
+constexpr auto MINIMUM_STRATUM_SERVERS = 4;
+constexpr auto AIRBITZ_DOMAIN = ".airbitz.co:";
+
+// A chunk reply is about 300K of hex, so only ask for one
+// if it saves enough round trips:
+constexpr size_t headerChunkMinimum = 16;
+
+// Replace a server if its median reply is this many times worse
+// than the best connected server, once we have enough samples to tell:
+constexpr double slowServerRatio = 3;
+constexpr unsigned slowServerSamples = 20;
+constexpr time_t slowServerInterval = 60;
+
+ConnectionPool::~ConnectionPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    wakeup();
+    if (thread_.joinable())
+        thread_.join();
+
+    close(wakeupPipe_[0]);
+    close(wakeupPipe_[1]);
+}
+
+ConnectionPool::ConnectionPool(BlockCache &blocks, ServerCache &servers):
+    blocks_(blocks),
+    servers_(servers)
+{
+    // Without the pipe, the loop could never wake up,
+    // and the process is out of file descriptors anyhow:
+    if (pipe(wakeupPipe_) < 0)
+    {
+        ABC_DebugLog("ConnectionPool: cannot create wakeup pipe (%d)", errno);
+        abort();
+    }
+
+    // Neither end may block, since the loop drains it dry
+    // and a full pipe already means a wakeup is pending:
+    for (auto fd: wakeupPipe_)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            ABC_DebugLog("ConnectionPool: cannot set up wakeup pipe (%d)",
+                         errno);
+            abort();
+        }
+    }
+}
+
+void
+ConnectionPool::add(TxUpdater &updater)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        updaters_.insert(&updater);
+        updater.alive_ = std::make_shared<bool>(true);
+
+        if (!running_)
+        {
+            running_ = true;
+            thread_ = std::thread(&ConnectionPool::loop, this);
+        }
+    }
+    wakeup();
+}
+
+void
+ConnectionPool::remove(TxUpdater &updater)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        updaters_.erase(&updater);
+        updater.alive_.reset();
+
+        // The dropped replies will never finish these,
+        // so forget them in case the updater comes back:
+        updater.wipAddresses_.clear();
+        updater.wipTxids_.clear();
+        updater.hedges_ = decltype(updater.hedges_)();
+        for (auto &watch: addressWatches_)
+            watch.second.updaters.erase(&updater);
+        saves_.erase(std::remove(saves_.begin(), saves_.end(),
+                                 &updater.cache_), saves_.end());
+    }
+
+    // Wait for any save that is already using the cache:
+    std::lock_guard<std::mutex> saveLock(saveMutex_);
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex_);
+        auto i = tasks_.begin();
+        while (i != tasks_.end())
+        {
+            if (&updater == i->first)
+                i = tasks_.erase(i);
+            else
+                ++i;
+        }
+    }
+
+    // Let the thread drop the connections if nobody else wants them:
+    wakeup();
+}
+
+void
+ConnectionPool::post(TxUpdater &updater, const std::function<void ()> &task)
+{
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex_);
+        tasks_.emplace_back(&updater, task);
+    }
+    wakeup();
+}
+
+void
+ConnectionPool::wakeup()
+{
+    // Extra wakeups are harmless, so a full pipe is fine:
+    uint8_t byte = 0;
+    if (write(wakeupPipe_[1], &byte, 1) < 0 && EAGAIN != errno)
+        ABC_DebugLog("ConnectionPool: wakeup failed (%d)", errno);
+}
+
+void
+ConnectionPool::loop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (running_)
+    {
+        auto nextWakeup = wakeupInternal();
+        int delay = nextWakeup.count() ? nextWakeup.count() : -1;
+        pollitemsUpdate();
+
+        // Let the other threads in while we sleep:
+        std::vector<Cache *> saves;
+        saves.swap(saves_);
+        std::unique_lock<std::mutex> saveLock(saveMutex_);
+        lock.unlock();
+
+        // Disk writes can be slow, so they happen outside the main lock:
+        for (auto *cache: saves)
+            cache->save().log(); // Failure is fine
+        saveLock.unlock();
+
+        if (zmq_poll(pollitems_.data(), pollitems_.size(), delay) < 0 &&
+                EINTR != errno)
+            ABC_DebugLog("ConnectionPool: poll failed (%d)", errno);
+        lock.lock();
+
+        // Drain the wakeup pipe, since one round handles them all:
+        if (pollitems_[0].revents)
+        {
+            uint8_t buffer[64];
+            while (0 < read(wakeupPipe_[0], buffer, sizeof(buffer)))
+                ;
+        }
+    }
+
+    disconnect();
+}
+
+std::chrono::milliseconds
+ConnectionPool::wakeupInternal()
+{
+    // Run the work posted from other threads,
+    // holding on to anything for wallets that haven't joined yet:
+    std::list<std::pair<TxUpdater *, std::function<void ()>>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex_);
+        tasks.swap(tasks_);
+    }
+    auto task = tasks.begin();
+    while (task != tasks.end())
+    {
+        if (updaters_.count(task->first))
+        {
+            task->second();
+            task = tasks.erase(task);
+        }
+        else
+        {
+            ++task;
+        }
+    }
+    if (!tasks.empty())
+    {
+        std::lock_guard<std::mutex> lock(tasksMutex_);
+        tasks_.splice(tasks_.begin(), tasks);
+    }
+
+    // Handle any old work that has finished:
+    std::chrono::milliseconds nextWakeup(0);
+    for (const auto &connection: connections_)
+    {
+        auto *bc = connection.bc;
+        if (auto *sc = connection.sc)
+        {
+            SleepTime sleep;
+            if (!sc->wakeup(sleep).log())
+                failedServers_.insert(bc->uri());
+            else
+            {
+                servers_.serverScoreUp(bc->uri(), 0);
+                nextWakeup = bc::client::min_sleep(nextWakeup, sleep);
+            }
+        }
+
+        if (auto *lc = connection.lc)
+            nextWakeup = bc::client::min_sleep(nextWakeup, lc->wakeup());
+    }
+
+    // Let each wallet schedule its own work:
+    bool wantConnection = false;
+    bool overrideServers = false;
+    std::set<std::string> overrideServerList;
+    for (auto *updater: updaters_)
+    {
+        nextWakeup = bc::client::min_sleep(nextWakeup, updater->wakeup());
+        if (updater->saveDue())
+            saves_.push_back(&updater->cache_);
+        if (!updater->wantConnection)
+            continue;
+
+        wantConnection = true;
+        if (updater->overrideBitcoinServers_)
+        {
+            overrideServers = true;
+            overrideServerList.insert(
+                updater->overrideBitcoinServerList_.begin(),
+                updater->overrideBitcoinServerList_.end());
+        }
+    }
+    overridesUpdate(overrideServers, overrideServerList);
+
+    // Grab block headers that we don't have:
+    std::set<size_t> leftover;
+    while (true)
+    {
+        const auto heights = blocks_.headerChunkNeeded(headerChunkSize);
+        if (heights.empty())
+            break;
+
+        // Steer clear of a server that came up short on this chunk:
+        const auto chunk = *heights.begin() / headerChunkSize;
+        const auto avoid = shortChunks_.find(chunk);
+        auto *bc = pickOtherServer(ServerRequestHeader,
+                                   shortChunks_.end() != avoid ?
+                                   avoid->second : "");
+        if (!bc)
+        {
+            leftover.insert(heights.begin(), heights.end());
+            break;
+        }
+
+        // Fetch the whole chunk at once if there are enough headers in it:
+        if (headerChunkMinimum <= heights.size() &&
+                blockHeaderChunkFetch(heights, bc))
+            continue;
+
+        // Otherwise, fetch the first one and save the rest for next time:
+        blockHeaderFetch(*heights.begin(), bc);
+        leftover.insert(++heights.begin(), heights.end());
+    }
+    for (const auto height: leftover)
+        blocks_.headerNeededAdd(height);
+    blocks_.save();
+    blocks_.onHeaderInvoke();
+    servers_.serverCacheSave();
+
+    // Send this round's requests, one write per server:
+    for (const auto &connection: connections_)
+    {
+        auto *sc = connection.sc;
+        if (sc && !sc->flush().log())
+            failedServers_.insert(sc->uri());
+    }
+
+    // Prune failed servers:
+    if (wantConnection)
+        rotateSlowServers();
+    for (const auto &uri: failedServers_)
+    {
+        auto i = connections_.begin();
+        while (i != connections_.end())
+        {
+            auto *bc = i->bc;
+            if (uri == bc->uri())
+            {
+                ABC_DebugLog("Disconnecting from %s", bc->uri().c_str());
+                servers_.serverScoreDown(bc->uri());
+                delete bc;
+                i = connections_.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+    failedServers_.clear();
+
+    // Connect to more servers, or drop them if nobody needs them:
+    if (!wantConnection)
+        disconnect();
+    else if (connections_.size() < NUM_CONNECT_SERVERS)
+        connect().log();
+
+    return nextWakeup;
+}
+
+void
+ConnectionPool::pollitemsUpdate()
+{
+    // Refill in place, so the storage from last time gets reused:
+    pollitems_.resize(1);
+    pollitems_[0] = zmq_pollitem_t{ nullptr, wakeupPipe_[0], ZMQ_POLLIN, 0 };
+    for (const auto &connection: connections_)
+    {
+        auto *sc = connection.sc;
+        if (sc && sc->connected())
+        {
+            // Only wait for writability when we have something to write:
+            short events = ZMQ_POLLIN;
+            if (sc->pollWrite())
+                events |= ZMQ_POLLOUT;
+            zmq_pollitem_t pollitem =
+            {
+                nullptr, sc->pollfd(), events, 0
+            };
+            pollitems_.push_back(pollitem);
+        }
+        else if (sc)
+        {
+            // Wake up as soon as any connection attempt finishes:
+            for (const auto fd: sc->pollConnecting())
+            {
+                zmq_pollitem_t pollitem =
+                {
+                    nullptr, fd, ZMQ_POLLOUT, 0
+                };
+                pollitems_.push_back(pollitem);
+            }
+        }
+
+        if (connection.lc)
+            pollitems_.push_back(connection.lc->pollitem());
+    }
+}
+
+static bool
+checkIfAirbitzServer(std::string str)
+{
+    std::string suffix = AIRBITZ_DOMAIN;
+
+    if (str.find(suffix) != std::string::npos)
+    {
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}
+
+void
+ConnectionPool::overridesUpdate(bool overrideServers,
+                                const std::set<std::string> &overrideServerList)
+{
+    if (overrideServers == overrideServers_ &&
+            overrideServerList == overrideServerList_)
+        return;
+    overrideServers_ = overrideServers;
+    overrideServerList_ = overrideServerList;
+
+    // Start the server lists over with the new settings:
+    stratumServers_.clear();
+    airbitzServers_.clear();
+    if (!overrideServers_)
+        return;
+
+    // Stop talking to anything the user didn't ask for:
+    auto i = connections_.begin();
+    while (i != connections_.end())
+    {
+        if (!overrideServerList_.count(i->bc->uri()))
+        {
+            ABC_DebugLog("Disconnecting from %s (not in the override list)",
+                         i->bc->uri().c_str());
+            delete i->bc;
+            i = connections_.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+Status
+ConnectionPool::connect()
+{
+    const bool overrideBitcoinServers = overrideServers_;
+    if (overrideBitcoinServers)
+    {
+        stratumServers_.assign(overrideServerList_.begin(),
+                               overrideServerList_.end());
+    }
+    else
+    {
+        // If we are out of fresh stratum servers, reload the list:
+        if (stratumServers_.empty())
+            stratumServers_ = servers_.getServers(ServerTypeStratum,
+                                                  MINIMUM_STRATUM_SERVERS * 2);
+        if (airbitzServers_.empty())
+            airbitzServers_ = servers_.getServers(ServerTypeAirbitz,
+                                                  MINIMUM_AIRBITZ_SERVERS * 2);
+    }
+
+    for (int i = 0; i < stratumServers_.size(); i++)
+        ABC_DebugLevel(1, "stratumServers_[%d]=%s", i, stratumServers_[i].c_str());
+
+    // Count the number of existing connections:
+    size_t stratumCount = 0;
+    size_t airbitzCount = 0;
+    for (const auto &connection: connections_)
+    {
+        if (connection.sc)
+            ++stratumCount;
+        if (checkIfAirbitzServer(connection.bc->uri()))
+            ++airbitzCount;
+    }
+
+    // Let's make some connections:
+    srand(time(nullptr));
+    while (connections_.size() < NUM_CONNECT_SERVERS && (stratumServers_.size()
+            || airbitzServers_.size()))
+    {
+        auto *serverList = &stratumServers_;
+
+        if (stratumServers_.size())
+        {
+            // Already assigned above
+        }
+        else if (airbitzServers_.size())
+        {
+            serverList = &airbitzServers_;
+        }
+
+        auto i = serverList->begin();
+        std::advance(i, rand() % serverList->size());
+
+        bool bAirbitzServer = checkIfAirbitzServer(*i);
+
+        // If the number of Airbitz servers we need equals the number of server slots left, then do not connect
+        // to non-Airbitz servers (only have this restriction if overrideBitcoinServers is false.
+        if (!overrideBitcoinServers)
+        {
+            if (NUM_CONNECT_SERVERS - connections_.size() <= (MINIMUM_AIRBITZ_SERVERS -
+                    airbitzCount))
+            {
+                if (!bAirbitzServer)
+                {
+                    serverList->erase(i);
+                    continue;
+                }
+            }
+        }
+        if (connectTo(*i, ServerTypeStratum).log())
+        {
+            stratumCount++;
+            if (bAirbitzServer)
+                airbitzCount++;
+        }
+        else
+        {
+            servers_.serverScoreDown(*i);
+        }
+        serverList->erase(i);
+    }
+
+    return Status();
+}
+
+void
+ConnectionPool::disconnect()
+{
+    if (connections_.empty())
+        return;
+
+    auto i = connections_.begin();
+    while (i != connections_.end())
+    {
+        delete i->bc;
+        i = connections_.erase(i);
+    }
+
+    ABC_DebugLog("Disconnected from all servers.");
+}
+
+Status
+ConnectionPool::connectTo(std::string server, ServerType serverType)
+{
+    std::string key;
+
+    // Parse out the key part:
+    size_t keyStart = server.find(' ');
+    if (keyStart != std::string::npos)
+    {
+        key = server.substr(keyStart + 1);
+        server.erase(keyStart);
+    }
+
+    // Make the connection:
+    std::unique_ptr<IBitcoinConnection> bc;
+    if (ServerTypeStratum == serverType)
+    {
+        // Stratum server:
+        std::unique_ptr<StratumConnection> sc(new StratumConnection());
+        ABC_CHECK(sc->connect(server, [this]()
+        {
+            wakeup();
+        }));
+        bc.reset(sc.release());
+    }
+    else
+    {
+        return ABC_ERROR(ABC_CC_Error, "Unknown server type " + server);
+    }
+
+    // Height callbacks:
+    subscribeHeight(bc.get());
+
+    // Check for mining fees:
+    auto sc = dynamic_cast<StratumConnection *>(bc.get());
+    if (generalEstimateFeesNeedUpdate() && sc)
+    {
+        fetchFeeEstimate(1, sc);
+        fetchFeeEstimate(2, sc);
+        fetchFeeEstimate(3, sc);
+        fetchFeeEstimate(4, sc);
+        fetchFeeEstimate(5, sc);
+        fetchFeeEstimate(6, sc);
+        fetchFeeEstimate(7, sc);
+    }
+    if (sc)
+        ABC_CHECK(sc->flush());
+
+    // Any hashes from an older connection to this server are stale:
+    for (auto &watch: addressWatches_)
+        watch.second.hashes.erase(bc->uri());
+
+    // Work out the type once, rather than on every pass through the loop:
+    connections_.push_back(Connection
+    {
+        bc.get(), sc, dynamic_cast<LibbitcoinConnection *>(bc.get())
+    });
+    bc.release();
+    ABC_DebugLog("Connecting to %s", server.c_str());
+
+    return Status();
+}
+
+IBitcoinConnection *
+ConnectionPool::pickServer(const std::string &name, ServerRequest request)
+{
+    // If the requested server is connected, only consider that:
+    for (const auto &connection: connections_)
+    {
+        auto *bc = connection.bc;
+        if (name == bc->uri() && !failedServers_.count(bc->uri()))
+            return bc->queueFull() ? nullptr : bc;
+    }
+
+    // Otherwise, use any server:
+    return pickOtherServer(request);
+}
+
+IBitcoinConnection *
+ConnectionPool::pickOtherServer(ServerRequest request, const std::string &name)
+{
+    IBitcoinConnection *best = nullptr;
+    IBitcoinConnection *fallback = nullptr;
+    double bestCost = 0;
+
+    for (const auto &connection: connections_)
+    {
+        auto *bc = connection.bc;
+        if (!bc->queueFull() && !failedServers_.count(bc->uri()))
+        {
+            if (name != bc->uri())
+            {
+                // Outstanding requests delay us, but less so
+                // on servers that have shown they can handle more:
+                const double cost =
+                    servers_.expectedResponseTime(bc->uri(), request) *
+                    (1 + double(bc->queueSize()) / bc->queueWindow());
+                if (!best || cost < bestCost)
+                {
+                    best = bc;
+                    bestCost = cost;
+                }
+            }
+            else
+            {
+                fallback = bc; // Not our first choice, but tolerable.
+            }
+        }
+    }
+
+    return best ? best : fallback;
+}
+
+void
+ConnectionPool::fail(const std::string &uri)
+{
+    failedServers_.insert(uri);
+}
+
+void
+ConnectionPool::addressWatch(TxUpdater &updater, const std::string &address)
+{
+    addressWatches_[address].updaters.insert(&updater);
+}
+
+void
+ConnectionPool::addressSubscribe(TxUpdater &updater,
+                                 const std::string &address,
+                                 IBitcoinConnection *bc)
+{
+    auto &watch = addressWatches_[address];
+    const bool joined = watch.updaters.insert(&updater).second;
+    const auto uri = bc->uri();
+
+    if (bc->addressSubscribed(address))
+    {
+        // The subscribe reply is still on its way, and will reach us too:
+        const auto hash = watch.hashes.find(uri);
+        if (watch.hashes.end() == hash)
+            return;
+
+        // A newcomer needs to catch up, but an existing watcher has
+        // seen every change, so it is already up-to-date:
+        if (joined)
+        {
+            if (updater.addressHash(address, uri, hash->second))
+                servers_.serverScoreUp(uri);
+        }
+        else
+        {
+            updater.cache_.addresses.updateSubscribe(address);
+        }
+        return;
+    }
+
+    auto onError = [this, address, uri](Status s)
+    {
+        ABC_DebugLog("%s: %s subscribe failed (%s)",
+                     uri.c_str(), address.c_str(), s.message().c_str());
+        addressWatches_[address].hashes.erase(uri);
+        if (!isRequestTimeout(s))
+            fail(uri);
+        servers_.setResponseError(uri, ServerRequestAddress);
+    };
+
+    auto onReply = [this, address, uri](const std::string &stateHash)
+    {
+        addressHash(address, uri, stateHash);
+    };
+
+    bc->addressSubscribe(onError, onReply, address);
+}
+
+void
+ConnectionPool::sendTx(StatusCallback status, DataSlice tx)
+{
+    // Pick one (and only one) stratum server for the broadcast,
+    // preferring one that is already connected:
+    StratumConnection *fallback = nullptr;
+    for (const auto &connection: connections_)
+    {
+        auto *sc = connection.sc;
+        if (sc && sc->connected())
+        {
+            sc->sendTx(status, tx);
+            return;
+        }
+        if (sc && !fallback)
+            fallback = sc;
+    }
+    if (fallback)
+    {
+        fallback->sendTx(status, tx);
+        return;
+    }
+
+    // If we get here, there are no stratum connections:
+    status(ABC_ERROR(ABC_CC_Error, "No stratum connections"));
+}
+
+void
+ConnectionPool::rotateSlowServers()
+{
+    // Only bother if there are fresh servers to replace the slow ones:
+    time_t now = time(nullptr);
+    if (overrideServers_ || stratumServers_.empty() ||
+            now - lastRotate_ < slowServerInterval)
+        return;
+    lastRotate_ = now;
+
+    std::map<std::string, unsigned long long> medians;
+    unsigned long long best = 0;
+    for (const auto &connection: connections_)
+    {
+        auto *bc = connection.bc;
+        const auto latency = servers_.latency(bc->uri());
+        if (latency.samples < slowServerSamples)
+            continue;
+
+        const auto median = latency.percentile(0.5);
+        medians[bc->uri()] = median;
+        if (!best || median < best)
+            best = median;
+    }
+
+    for (const auto &median: medians)
+    {
+        if (slowServerRatio * best < median.second)
+        {
+            ABC_DebugLog("%s: too slow (%llu ms median vs %llu ms)",
+                         median.first.c_str(), median.second, best);
+            failedServers_.insert(median.first);
+        }
+    }
+}
+
+void
+ConnectionPool::subscribeHeight(IBitcoinConnection *bc)
+{
+    const auto uri = bc->uri();
+    auto onError = [this, uri](Status s)
+    {
+        ABC_DebugLog("%s: height subscribe failed (%s)",
+                     uri.c_str(), s.message().c_str());
+        failedServers_.insert(uri); // Nothing will retry this
+        servers_.setResponseError(uri, ServerRequestHeight);
+    };
+
+    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
+
+    auto onReply = [this, uri, queryTime](size_t height)
+    {
+        // Set the response time in the cache
+        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
+        servers_.setResponseTime(uri, responseTime - queryTime,
+                                 ServerRequestHeight);
+
+        ABC_DebugLog("%s: height %d returned %d ms", uri.c_str(), height,
+                     responseTime - queryTime);
+        size_t oldHeight = blocks_.heightSet(height);
+
+        if (oldHeight > height + 2)
+        {
+            // This server is behind in block height. Disconnect then penalize it a lot
+            servers_.serverScoreDown(uri, 20);
+        }
+        else if (oldHeight <= height)
+        {
+            servers_.serverScoreUp(uri); // Point for returning a valid height
+            if (oldHeight < height)
+            {
+                servers_.serverScoreUp(uri); // Point for returning a newer height
+
+                // Every wallet needs to re-check its unconfirmed txs:
+                for (auto *updater: updaters_)
+                    updater->heightChanged();
+            }
+        }
+    };
+
+    bc->heightSubscribe(onError, onReply);
+}
+
+void
+ConnectionPool::addressHash(const std::string &address,
+                            const std::string &uri, const std::string &hash)
+{
+    auto &watch = addressWatches_[address];
+    watch.hashes[uri] = hash;
+
+    bool dirty = false;
+    for (auto *updater: watch.updaters)
+        dirty |= updater->addressHash(address, uri, hash);
+    if (dirty)
+        servers_.serverScoreUp(uri); // Point for returning a new hash
+}
+
+void
+ConnectionPool::fetchFeeEstimate(size_t blocks, StratumConnection *sc)
+{
+    const auto uri = sc->uri();
+    auto onError = [this, blocks, uri](Status s)
+    {
+        ABC_DebugLog("%s: get fees for %d blocks failed (%s)",
+                     uri.c_str(), blocks, s.message().c_str());
+    };
+
+    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
+    auto onReply = [this, blocks, uri, queryTime](double fee)
+    {
+        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
+        servers_.setResponseTime(uri, responseTime - queryTime,
+                                 ServerRequestOther);
+
+        ABC_DebugLog("%s: returned fee %lf for %d blocks %d ms",
+                     uri.c_str(), fee, blocks, responseTime - queryTime);
+        generalEstimateFeesUpdate(blocks, fee);
+    };
+
+    sc->feeEstimateFetch(onError, onReply, blocks);
+}
+
+void
+ConnectionPool::blockHeaderFetch(size_t height, IBitcoinConnection *bc)
+{
+    const auto uri = bc->uri();
+    auto onError = [this, height, uri](Status s)
+    {
+        ABC_DebugLog("%s: header %d fetch failed (%s)",
+                     uri.c_str(), height, s.message().c_str());
+        if (!isRequestTimeout(s))
+            failedServers_.insert(uri);
+        servers_.setResponseError(uri, ServerRequestHeader);
+
+        // Let somebody else have a try:
+        blocks_.headerNeededAdd(height);
+    };
+
+    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
+    auto onReply = [this, height, uri,
+                          queryTime](const bc::block_header_type &header)
+    {
+        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
+        servers_.setResponseTime(uri, responseTime - queryTime,
+                                 ServerRequestHeader);
+
+        ABC_DebugLog("%s: header %d fetched %d ms",
+                     uri.c_str(), height, responseTime - queryTime);
+
+        bool didInsert = blocks_.headerInsert(height, header);
+        if (didInsert)
+            servers_.serverScoreUp(uri);
+    };
+
+    bc->blockHeaderFetch(onError, onReply, height);
+}
+
+bool
+ConnectionPool::blockHeaderChunkFetch(const std::set<size_t> &heights,
+                                      IBitcoinConnection *bc)
+{
+    const size_t chunk = *heights.begin() / headerChunkSize;
+    const size_t first = chunk * headerChunkSize;
+
+    const auto uri = bc->uri();
+    auto onError = [this, chunk, heights, uri](Status s)
+    {
+        ABC_DebugLog("%s: header chunk %d fetch failed (%s)",
+                     uri.c_str(), chunk, s.message().c_str());
+        if (!isRequestTimeout(s))
+            failedServers_.insert(uri);
+        servers_.setResponseError(uri, ServerRequestHeader);
+
+        // Let somebody else have a try:
+        shortChunks_[chunk] = uri;
+        for (const auto height: heights)
+            blocks_.headerNeededAdd(height);
+    };
+
+    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
+    auto onReply = [this, chunk, first, heights, uri, queryTime](
+                       const std::vector<bc::block_header_type> &headers)
+    {
+        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
+        servers_.setResponseTime(uri, responseTime - queryTime,
+                                 ServerRequestHeader);
+
+        ABC_DebugLog("%s: header chunk %d fetched %d ms",
+                     uri.c_str(), chunk, responseTime - queryTime);
+
+        // Only keep the headers we actually need:
+        bool didInsert = false;
+        bool isShort = false;
+        for (const auto height: heights)
+        {
+            if (height - first < headers.size())
+            {
+                didInsert |= blocks_.headerInsert(height,
+                                                  headers[height - first]);
+            }
+            else
+            {
+                blocks_.headerNeededAdd(height); // Past the server's tip
+                isShort = true;
+            }
+        }
+        if (isShort)
+            shortChunks_[chunk] = uri;
+        else
+            shortChunks_.erase(chunk);
+        if (didInsert)
+            servers_.serverScoreUp(uri);
+    };
+
+    return bc->headerChunkFetch(onError, onReply, chunk);
+}
+
+} // namespace abcd
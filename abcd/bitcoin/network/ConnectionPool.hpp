@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2016, Airbitz, Inc.
+ * All rights reserved.
+ *
+ * See the LICENSE file for more information.
+ */
+
+#ifndef ABCD_BITCOIN_NETWORK_CONNECTION_POOL_HPP
+#define ABCD_BITCOIN_NETWORK_CONNECTION_POOL_HPP
+
+#include "../Typedefs.hpp"
+#include "../cache/ServerCache.hpp"
+#include "../../util/Data.hpp"
+#include "../../util/Status.hpp"
+#include <zmq.h>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace abcd {
+
+class BlockCache;
+class Cache;
+class IBitcoinConnection;
+class LibbitcoinConnection;
+class StratumConnection;
+class TxUpdater;
+
+/**
+ * The server connections shared by every wallet,
+ * along with the one thread that drives them.
+ *
+ * Each wallet's TxUpdater joins the pool while its watcher is running,
+ * and the pool thread does all of the wallet's network work.
+ * Height subscriptions, fee estimates, and block headers
+ * only need doing once for the whole app, so the pool handles those itself.
+ *
+ * Address subscriptions are shared the same way:
+ * each server only hears about an address once,
+ * and the pool hands its status hashes to every wallet watching it.
+ *
+ * Server overrides are app-wide for the same reason:
+ * if any wallet in the pool overrides the servers,
+ * every wallet uses the combined override list and nothing else.
+ */
+class ConnectionPool
+{
+public:
+    ~ConnectionPool();
+    ConnectionPool(BlockCache &blocks, ServerCache &servers);
+
+    /**
+     * Starts doing network work for a wallet.
+     * Starts the pool thread if it isn't running yet.
+     */
+    void
+    add(TxUpdater &updater);
+
+    /**
+     * Stops doing network work for a wallet.
+     * Once this returns, the pool will never touch the updater again,
+     * and replies to its old requests are dropped.
+     * The updater can join again later with a clean slate.
+     */
+    void
+    remove(TxUpdater &updater);
+
+    /**
+     * Runs a task on the pool thread, once the updater is in the pool.
+     * Tasks still waiting when the updater leaves are dropped.
+     */
+    void
+    post(TxUpdater &updater, const std::function<void ()> &task);
+
+    /**
+     * Makes the pool thread re-check its work.
+     * Safe to call from any thread, including the pool thread itself.
+     */
+    void
+    wakeup();
+
+    // Everything below is only for use on the pool thread: ----------------
+
+    /**
+     * Finds the requested server, assuming it is even connected and ready.
+     * @return The best available server,
+     * or a null pointer if the server is busy.
+     */
+    IBitcoinConnection *
+    pickServer(const std::string &name, ServerRequest request);
+
+    /**
+     * Picks the server with the lowest expected latency for this request,
+     * counting the replies it already owes us,
+     * and avoiding the one provided if possible.
+     * @return The best available server,
+     * or a null pointer if there are no free servers.
+     */
+    IBitcoinConnection *
+    pickOtherServer(ServerRequest request, const std::string &name="");
+
+    /**
+     * Marks a server for disconnection at the end of this round.
+     */
+    void
+    fail(const std::string &uri);
+
+    /**
+     * Passes the address's status hashes on to this wallet from now on,
+     * whichever wallet made the subscription.
+     */
+    void
+    addressWatch(TxUpdater &updater, const std::string &address);
+
+    /**
+     * Subscribes a wallet to an address on this server.
+     * If another wallet is already subscribed there,
+     * the new wallet gets the current status hash instead.
+     */
+    void
+    addressSubscribe(TxUpdater &updater, const std::string &address,
+                     IBitcoinConnection *bc);
+
+    /**
+     * Broadcasts a transaction.
+     * All errors go to the `status` callback.
+     */
+    void
+    sendTx(StatusCallback status, DataSlice tx);
+
+    ConnectionPool(const ConnectionPool &copy) = delete;
+    ConnectionPool &operator=(const ConnectionPool &copy) = delete;
+
+private:
+    BlockCache &blocks_;
+    ServerCache &servers_;
+
+    // Self-pipe for waking the thread:
+    int wakeupPipe_[2];
+
+    // Work posted from other threads:
+    std::mutex tasksMutex_;
+    std::list<std::pair<TxUpdater *, std::function<void ()>>> tasks_;
+
+    // The pool thread holds this while saving caches outside the main lock,
+    // so `remove` can wait for it to finish:
+    std::mutex saveMutex_;
+
+    // The pool thread holds this lock except while it is sleeping,
+    // and it guards everything below:
+    std::mutex mutex_;
+    std::thread thread_;
+    bool running_ = false;
+    std::set<TxUpdater *> updaters_;
+    std::vector<Cache *> saves_; // Caches to save once the lock is free
+
+    /**
+     * A server connection, with its concrete type worked out up front.
+     */
+    struct Connection
+    {
+        IBitcoinConnection *bc;
+        StratumConnection *sc; // Null unless this is a stratum server
+        LibbitcoinConnection *lc; // Null unless this is a libbitcoin server
+    };
+    std::vector<Connection> connections_;
+    std::vector<std::string> stratumServers_;
+    std::vector<std::string> airbitzServers_;
+
+    // The combined server overrides from the wallets that want connections:
+    bool overrideServers_ = false;
+    std::set<std::string> overrideServerList_;
+
+    /**
+     * A list of servers that have failed.
+     */
+    std::set<std::string> failedServers_;
+
+    /**
+     * The last time we checked for persistently slow servers.
+     */
+    time_t lastRotate_ = 0;
+
+    /**
+     * The wallets watching each address,
+     * along with the latest status hash from each server subscribed to it.
+     */
+    struct AddressWatch
+    {
+        std::set<TxUpdater *> updaters;
+        std::map<std::string, std::string> hashes; // By server uri
+    };
+    std::map<std::string, AddressWatch> addressWatches_;
+
+    /**
+     * The server that last failed or came up short on each header chunk,
+     * so the next attempt can go somewhere else.
+     */
+    std::map<size_t, std::string> shortChunks_;
+
+    // Only touched by the pool thread, even while sleeping:
+    std::vector<zmq_pollitem_t> pollitems_;
+
+    void
+    loop();
+
+    /**
+     * Performs any pending work.
+     * Returns the number of milliseconds until the next work will be ready.
+     */
+    std::chrono::milliseconds
+    wakeupInternal();
+
+    /**
+     * Refills the list of sockets that the main loop should sleep on,
+     * with the wakeup pipe first.
+     */
+    void
+    pollitemsUpdate();
+
+    /**
+     * Applies this round's server overrides,
+     * dropping any connection the overrides don't allow.
+     */
+    void
+    overridesUpdate(bool overrideServers,
+                    const std::set<std::string> &overrideServerList);
+
+    /**
+     * Tops up the connections, honoring any server overrides.
+     */
+    Status
+    connect();
+
+    void
+    disconnect();
+
+    Status
+    connectTo(std::string server, ServerType serverType);
+
+    /**
+     * Marks connections that are much slower than their peers as failed,
+     * so the next connect replaces them with fresh servers.
+     */
+    void
+    rotateSlowServers();
+
+    void
+    subscribeHeight(IBitcoinConnection *bc);
+
+    /**
+     * Hands a new status hash to every wallet watching the address.
+     */
+    void
+    addressHash(const std::string &address, const std::string &uri,
+                const std::string &hash);
+
+    void
+    fetchFeeEstimate(size_t blocks, StratumConnection *sc);
+
+    void
+    blockHeaderFetch(size_t height, IBitcoinConnection *bc);
+
+    /**
+     * Fetches the chunk containing these heights in a single request.
+     * @return false if the server cannot do this.
+     */
+    bool
+    blockHeaderChunkFetch(const std::set<size_t> &heights,
+                          IBitcoinConnection *bc);
+};
+
+} // namespace abcd
+
+#endif
@@ -10,7 +10,9 @@
 
 #include "../Typedefs.hpp"
 #include "../../util/Data.hpp"
+#include "../../util/Status.hpp"
 #include <map>
+#include <vector>
 
 namespace abcd {
 
@@ -26,6 +28,30 @@ AddressUpdateCallback;
 typedef std::function<void (const libbitcoin::transaction_type &tx)> TxCallback;
 typedef std::function<void (const libbitcoin::block_header_type &header)>
 HeaderCallback;
+typedef std::function<void (const std::vector<libbitcoin::block_header_type> &headers)>
+HeaderChunkCallback;
+
+/**
+ * The number of block headers in a chunk (one difficulty period).
+ */
+constexpr size_t headerChunkSize = 2016;
+
+/**
+ * The error message for a single request that has missed its deadline.
+ */
+constexpr auto requestTimeoutMessage = "Request timed out";
+
+/**
+ * Returns true if a request failed because it missed its deadline.
+ * The connection itself is still fine, so the caller should retry
+ * somewhere else instead of dropping the server.
+ */
+inline bool
+isRequestTimeout(const Status &status)
+{
+    return ABC_CC_ServerError == status.value() &&
+           requestTimeoutMessage == status.message();
+}
 
 /**
  * A connection to the Bitcoin network.
@@ -48,6 +74,20 @@ public:
     virtual bool
     queueFull() = 0;
 
+    /**
+     * Returns the number of requests waiting for a reply.
+     */
+    virtual size_t
+    queueSize() = 0;
+
+    /**
+     * Returns the number of requests this connection can have outstanding
+     * before `queueFull` kicks in.
+     * This can change as the connection learns how fast the server is.
+     */
+    virtual size_t
+    queueWindow() = 0;
+
     /**
      * Begins watching for blockchain height changes.
      */
@@ -93,6 +133,17 @@ public:
     blockHeaderFetch(const StatusCallback &onError,
                      const HeaderCallback &onReply,
                      size_t height) = 0;
+
+    /**
+     * Fetches the `headerChunkSize` block headers starting at
+     * `chunk * headerChunkSize` in a single request.
+     * The reply may come up short at the end of the chain.
+     * @return false if the server cannot do this.
+     */
+    virtual bool
+    headerChunkFetch(const StatusCallback &onError,
+                     const HeaderChunkCallback &onReply,
+                     size_t chunk) = 0;
 };
 
 } // namespace abcd
@@ -91,6 +91,18 @@ LibbitcoinConnection::queueFull()
     return 10 < queuedQueries_;
 }
 
+size_t
+LibbitcoinConnection::queueSize()
+{
+    return queuedQueries_;
+}
+
+size_t
+LibbitcoinConnection::queueWindow()
+{
+    return 10;
+}
+
 void
 LibbitcoinConnection::heightSubscribe(const StatusCallback &onError,
                                       const HeightCallback &onReply)
@@ -228,6 +240,15 @@ LibbitcoinConnection::blockHeaderFetch(const StatusCallback &onError,
     codec_.fetch_block_header(errorShim, replyShim, height);
 }
 
+bool
+LibbitcoinConnection::headerChunkFetch(const StatusCallback &onError,
+                                       const HeaderChunkCallback &onReply,
+                                       size_t chunk)
+{
+    // The obelisk protocol has no way to do this:
+    return false;
+}
+
 void
 LibbitcoinConnection::fetchHeight()
 {
@@ -36,6 +36,12 @@ public:
     bool
     queueFull() override;
 
+    size_t
+    queueSize() override;
+
+    size_t
+    queueWindow() override;
+
     void
     heightSubscribe(const StatusCallback &onError,
                     const HeightCallback &onReply) override;
@@ -63,6 +69,11 @@ public:
                      const HeaderCallback &onReply,
                      size_t height) override;
 
+    bool
+    headerChunkFetch(const StatusCallback &onError,
+                     const HeaderChunkCallback &onReply,
+                     size_t chunk) override;
+
 private:
     // Connection:
     std::string uri_;
@@ -12,12 +12,29 @@
 #include "../../json/JsonArray.hpp"
 #include "../../json/JsonObject.hpp"
 #include "../../util/Debug.hpp"
+#include <string.h>
 #include <algorithm>
 
 namespace abcd {
 
 constexpr std::chrono::seconds keepaliveTime(60);
 constexpr std::chrono::seconds timeout(30);
+// Short enough that a hedge or retry can route around a stalled request:
+constexpr std::chrono::seconds requestTimeout(10);
+
+// Request window limits:
+constexpr double windowInitial = 10;
+constexpr double windowMin = 2;
+constexpr double windowMax = 64;
+
+// A reply is late if it takes this much longer than the base latency:
+constexpr double congestionRatio = 3;
+constexpr std::chrono::milliseconds congestionSlack(500);
+// A request is stuck if it is still waiting after this long:
+constexpr auto stuckTime = timeout / 3;
+
+// Stop taking requests if this much is still waiting for the socket:
+constexpr size_t sendBacklog = 65536;
 
 struct RequestJson:
     public JsonObject
@@ -52,6 +69,12 @@ struct ReplyJson:
     ABC_JSON_VALUE(params, "params", JsonArray);
 };
 
+StratumConnection::StratumConnection():
+    window_(windowInitial),
+    baseLatency_(0)
+{
+}
+
 StratumConnection::~StratumConnection()
 {
     for (auto &i: pending_)
@@ -122,7 +145,8 @@ StratumConnection::sendTx(const StatusCallback &onDone, DataSlice tx)
 }
 
 Status
-StratumConnection::connect(const std::string &rawUri)
+StratumConnection::connect(const std::string &rawUri,
+                           const std::function<void ()> &onLookup)
 {
     uri_ = rawUri;
 
@@ -141,7 +165,8 @@ StratumConnection::connect(const std::string &rawUri)
     auto serverPort = server.substr(last + 1, std::string::npos);
 
     // Connect to the server:
-    ABC_CHECK(connection_.connect(serverName, atoi(serverPort.c_str())));
+    ABC_CHECK(connection_.connect(serverName, atoi(serverPort.c_str()),
+                                  onLookup));
     lastKeepalive_ = std::chrono::steady_clock::now();
 
     return Status();
@@ -150,24 +175,39 @@ StratumConnection::connect(const std::string &rawUri)
 Status
 StratumConnection::wakeup(SleepTime &sleep)
 {
-    // Read any data available on the socket:
-    DataChunk buffer;
-    ABC_CHECK(connection_.read(buffer));
-    incoming_ += std::string(buffer.begin(), buffer.end());
+    // Finish connecting first:
+    ABC_CHECK(connection_.wakeup(sleep));
+    if (!connection_.connected())
+        return Status();
+
+    // Read any data available on the socket.
+    // Handle whatever arrived before reporting a closed connection:
+    const auto readStatus = connection_.read(incoming_);
 
-    // Extract any incoming messages:
+    // Process the complete messages in place:
+    size_t start = 0;
     while (true)
     {
-        // Find the newline:
-        auto where = std::find(incoming_.begin(), incoming_.end(), '\n');
-        if (incoming_.end() == where)
+        // Find the newline, skipping what we have already searched:
+        const auto begin = incoming_.data() + start;
+        const auto scan = std::max(start, incomingScanned_);
+        if (incoming_.size() <= scan)
+            break;
+        const auto where = static_cast<const uint8_t *>(
+                               memchr(incoming_.data() + scan, '\n',
+                                      incoming_.size() - scan));
+        if (!where)
             break;
 
-        // Extract and process the message:
-        ABC_CHECK(handleMessage(std::string(incoming_.begin(), where + 1)));
-        incoming_.erase(incoming_.begin(), where + 1);
+        ABC_CHECK(handleMessage(DataSlice(begin, where + 1)));
+        start = where + 1 - incoming_.data();
     }
 
+    // Move any partial message to the front for next time:
+    incoming_.erase(incoming_.begin(), incoming_.begin() + start);
+    incomingScanned_ = incoming_.size();
+    ABC_CHECK(readStatus);
+
     // We need to wake up every minute:
     auto now = std::chrono::steady_clock::now();
     if (lastKeepalive_ + keepaliveTime < now)
@@ -184,9 +224,36 @@ StratumConnection::wakeup(SleepTime &sleep)
     sleep = std::chrono::duration_cast<SleepTime>(
                 lastKeepalive_ + keepaliveTime - now);
 
+    // Send anything the replies or the keepalive queued up:
+    ABC_CHECK(flush());
+
+    // Fail any requests that have missed their deadlines:
+    while (!deadlines_.empty() && deadlines_.top().first <= now)
+    {
+        auto i = pending_.find(deadlines_.top().second);
+        deadlines_.pop();
+        if (pending_.end() != i)
+        {
+            const auto onError = i->second.onError;
+            pending_.erase(i);
+            onError(ABC_ERROR(ABC_CC_ServerError, requestTimeoutMessage));
+        }
+    }
+    if (!deadlines_.empty())
+        sleep = std::min(sleep, std::chrono::duration_cast<SleepTime>(
+                             deadlines_.top().first - now));
+
     // Check the timeout:
     if (pending_.size())
     {
+        // Back off if the oldest request is stuck:
+        const auto sent = pending_.begin()->second.sent;
+        if (sent + stuckTime < now && lastDecrease_ < sent)
+        {
+            window_ = std::max(windowMin, window_ / 2);
+            lastDecrease_ = now;
+        }
+
         if (lastProgress_ + timeout < now)
             return ABC_ERROR(ABC_CC_ServerError, "Connection timed out");
         sleep = std::min(sleep, std::chrono::duration_cast<SleepTime>(
@@ -196,6 +263,20 @@ StratumConnection::wakeup(SleepTime &sleep)
     return Status();
 }
 
+Status
+StratumConnection::flush()
+{
+    if (outgoing_.empty())
+        return connection_.flush();
+
+    // The server handles pipelined requests in order,
+    // so one line per request in one buffer is all the batching we need:
+    ABC_CHECK(connection_.send(outgoing_));
+    outgoing_.clear();
+
+    return Status();
+}
+
 std::string
 StratumConnection::uri()
 {
@@ -205,7 +286,21 @@ StratumConnection::uri()
 bool
 StratumConnection::queueFull()
 {
-    return 10 < pending_.size();
+    return !connection_.connected() ||
+           queueWindow() < pending_.size() ||
+           sendBacklog < outgoing_.size() + connection_.sendPending();
+}
+
+size_t
+StratumConnection::queueSize()
+{
+    return pending_.size();
+}
+
+size_t
+StratumConnection::queueWindow()
+{
+    return window_;
 }
 
 void
@@ -370,6 +465,40 @@ StratumConnection::blockHeaderFetch(const StatusCallback &onError,
     sendMessage("blockchain.block.get_header", params, onError, decoder);
 }
 
+bool
+StratumConnection::headerChunkFetch(const StatusCallback &onError,
+                                    const HeaderChunkCallback &onReply,
+                                    size_t chunk)
+{
+    JsonArray params;
+    params.append(json_integer(chunk));
+
+    auto decoder = [onReply](JsonPtr payload) -> Status
+    {
+        if (!json_is_string(payload.get()))
+            return ABC_ERROR(ABC_CC_JSONError, "Bad reply format");
+
+        // The reply is a hex string of back-to-back 80-byte headers:
+        DataChunk rawHeaders;
+        if (!base16Decode(rawHeaders, json_string_value(payload.get())))
+            return ABC_ERROR(ABC_CC_ParseError, "Bad header chunk format");
+        if (rawHeaders.size() % 80 || headerChunkSize * 80 < rawHeaders.size())
+            return ABC_ERROR(ABC_CC_ParseError, "Bad header chunk size");
+
+        std::vector<bc::block_header_type> headers(rawHeaders.size() / 80);
+        for (size_t i = 0; i < headers.size(); ++i)
+            ABC_CHECK(decodeHeader(headers[i],
+                                   bc::data_slice(rawHeaders.data() + 80 * i,
+                                                  rawHeaders.data() + 80 * i + 80)));
+
+        onReply(headers);
+        return Status();
+    };
+
+    sendMessage("blockchain.block.get_chunk", params, onError, decoder);
+    return true;
+}
+
 void
 StratumConnection::sendMessage(const std::string &method, JsonPtr params,
                                const StatusCallback &onError,
@@ -382,28 +511,63 @@ StratumConnection::sendMessage(const std::string &method, JsonPtr params,
     query.methodSet(method);
     query.paramsSet(params);
 
-    auto s = connection_.send(query.encode(true) + '\n');
-    if (!s)
-        return onError(s);
+    outgoing_ += query.encode(true) + '\n';
 
     // Start the timeout if this is the first message in the queue:
+    const auto now = std::chrono::steady_clock::now();
     if (pending_.empty())
-        lastProgress_ = std::chrono::steady_clock::now();
+        lastProgress_ = now;
+
+    // If the flush fails, the connection is done,
+    // and the destructor reports the error to everybody waiting:
+    pending_[id] = Pending{ onError, decoder, now };
+    deadlines_.push(Deadline(now + requestTimeout, id));
+}
 
-    // The message has been sent, so save the decoder:
-    pending_[id] = Pending{ onError, decoder };
+void
+StratumConnection::windowUpdate(std::chrono::steady_clock::time_point sent,
+                                std::chrono::steady_clock::time_point now)
+{
+    // Track the fastest reply, but let it drift up slowly
+    // in case the route to the server changes:
+    const auto latency = now - sent;
+    if (!baseLatency_.count() || latency < baseLatency_)
+        baseLatency_ = latency;
+    else
+        baseLatency_ += (latency - baseLatency_) / 64;
+
+    const auto late = std::max<std::chrono::steady_clock::duration>(
+                          std::chrono::duration_cast<
+                          std::chrono::steady_clock::duration>(
+                              baseLatency_ * congestionRatio),
+                          baseLatency_ + congestionSlack);
+    if (late < latency)
+    {
+        // Requests sent before the last decrease don't count again:
+        if (lastDecrease_ < sent)
+        {
+            window_ = std::max(windowMin, window_ / 2);
+            lastDecrease_ = now;
+        }
+    }
+    else
+    {
+        window_ = std::min(windowMax, window_ + 1 / window_);
+    }
 }
 
 Status
-StratumConnection::handleMessage(const std::string &message)
+StratumConnection::handleMessage(DataSlice message)
 {
     ReplyJson json;
-    ABC_CHECK(json.decode(message));
+    ABC_CHECK(json.decode(reinterpret_cast<const char *>(message.data()),
+                          message.size()));
     if (json.idOk())
     {
         auto i = pending_.find(json.id());
         if (pending_.end() != i)
         {
+            windowUpdate(i->second.sent, std::chrono::steady_clock::now());
             auto s = i->second.decoder(json.result());
             if (!s)
                 i->second.onError(s);
@@ -12,6 +12,7 @@
 #include "TcpConnection.hpp"
 #include <chrono>
 #include <map>
+#include <queue>
 
 namespace abcd {
 
@@ -54,10 +55,17 @@ public:
     sendTx(const StatusCallback &onDone, DataSlice tx);
 
     /**
-     * Connects to the specified stratum server.
+     * Begins connecting to the specified stratum server.
+     * Requests made before the connection is up wait in the queue.
+     * @param onLookup called from another thread once the DNS lookup is done.
      */
     Status
-    connect(const std::string &uri);
+    connect(const std::string &uri, const std::function<void ()> &onLookup);
+
+    /**
+     * Returns true once the connection to the server is up.
+     */
+    bool connected() const { return connection_.connected(); }
 
     /**
      * Performs any pending work,
@@ -67,10 +75,35 @@ public:
     wakeup(SleepTime &sleep);
 
     /**
-     * Obtains the socket that the main loop should sleep on.
+     * Writes all the requests queued since the last flush
+     * to the socket in a single send.
+     * Anything the socket cannot take right now stays queued
+     * until it becomes writable.
+     */
+    Status
+    flush();
+
+    /**
+     * Obtains the socket that the main loop should sleep on,
+     * once the connection is up.
      */
     int pollfd() const { return connection_.pollfd(); }
 
+    /**
+     * Returns true if the main loop should wake up
+     * when the socket becomes writable.
+     */
+    bool pollWrite() const { return connection_.sendPending(); }
+
+    /**
+     * Obtains the sockets the main loop should wait on for writability
+     * while the connection is still being set up.
+     */
+    const std::vector<int> &
+    pollConnecting() const { return connection_.pollConnecting(); }
+
+    StratumConnection();
+
     // IBitcoinConnection interface:
     std::string
     uri() override;
@@ -78,6 +111,12 @@ public:
     bool
     queueFull() override;
 
+    size_t
+    queueSize() override;
+
+    size_t
+    queueWindow() override;
+
     void
     heightSubscribe(const StatusCallback &onError,
                     const HeightCallback &onReply) override;
@@ -105,24 +144,42 @@ public:
                      const HeaderCallback &onReply,
                      size_t height) override;
 
+    bool
+    headerChunkFetch(const StatusCallback &onError,
+                     const HeaderChunkCallback &onReply,
+                     size_t chunk) override;
+
 private:
     typedef std::function<Status (JsonPtr payload)> Decoder;
 
     // Socket:
     std::string uri_;
     TcpConnection connection_;
-    std::string incoming_;
+    DataChunk incoming_; // Received data, starting at a message boundary
+    size_t incomingScanned_ = 0; // Bytes of incoming_ known to have no newline
 
     // Sending:
     unsigned lastId = 0;
+    std::string outgoing_; // Requests waiting for the next flush
     struct Pending
     {
         StatusCallback onError;
         Decoder decoder;
-        // TODO: Add timeout logic
+        std::chrono::steady_clock::time_point sent;
     };
     std::map<unsigned, Pending> pending_;
 
+    // Request deadlines, soonest first.
+    // Entries for requests that already have replies are skipped:
+    typedef std::pair<std::chrono::steady_clock::time_point, unsigned> Deadline;
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>>
+            deadlines_;
+
+    // Request window (additive increase, multiplicative decrease):
+    double window_;
+    std::chrono::steady_clock::duration baseLatency_;
+    std::chrono::steady_clock::time_point lastDecrease_;
+
     // Timeout:
     std::chrono::steady_clock::time_point lastProgress_;
 
@@ -134,7 +191,7 @@ private:
     std::map<std::string, AddressUpdateCallback> addressCallbacks_;
 
     /**
-     * Sends a message and sets up the reply decoder.
+     * Queues a message for the next flush and sets up the reply decoder.
      * If anything goes wrong (including errors returned by the decoder),
      * the error callback will be called.
      */
@@ -142,11 +199,20 @@ private:
     sendMessage(const std::string &method, JsonPtr params,
                 const StatusCallback &onError, const Decoder &decoder);
 
+    /**
+     * Grows the request window while replies come back about as fast
+     * as the quickest reply we have seen, and halves it (at most once
+     * per round trip) when they slow down.
+     */
+    void
+    windowUpdate(std::chrono::steady_clock::time_point sent,
+                 std::chrono::steady_clock::time_point now);
+
     /**
      * Decodes and handles a complete message from the server.
      */
     Status
-    handleMessage(const std::string &message);
+    handleMessage(DataSlice message);
 };
 
 } // namespace abcd
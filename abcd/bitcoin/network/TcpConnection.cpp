@@ -9,51 +9,102 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
 
 namespace abcd {
 
-static int
-timeoutConnect(int sock, struct sockaddr *addr,
-               socklen_t addr_len, struct timeval *tv)
-{
-    fd_set fdset;
-    int flags = 0;
-    int so_error;
-    socklen_t len = sizeof(so_error);
+// Large enough for most replies in one call:
+constexpr size_t readSize = 65536;
+
+// Connection setup:
+constexpr std::chrono::seconds connectTimeout(10);
+constexpr std::chrono::milliseconds attemptDelay(250); // RFC 8305
 
-    if ((flags = fcntl(sock, F_GETFL, 0)) < 0)
-        return -1;
+/**
+ * The results of a DNS lookup running on a background thread.
+ */
+struct TcpConnection::Lookup
+{
+    std::mutex mutex;
+    bool done = false;
+    std::vector<Address> addresses;
+    std::function<void ()> onDone; // Cleared once the connection is gone
+};
 
-    if (fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0)
-        return -1;
+static void
+lookupTask(std::shared_ptr<TcpConnection::Lookup> lookup,
+           std::string hostname, unsigned port)
+{
+    struct addrinfo hints {};
+    struct addrinfo *list = nullptr;
+    hints.ai_family = AF_UNSPEC; // Allow IPv6 or IPv4
+    hints.ai_socktype = SOCK_STREAM; // TCP only
+    const int error = getaddrinfo(hostname.c_str(),
+                                  std::to_string(port).c_str(), &hints, &list);
 
-    if (connect(sock, addr, addr_len) == 0)
-        goto exit;
+    // Alternate between address families, so a broken IPv6 route
+    // can't hold up a working IPv4 one (RFC 8305 "Happy Eyeballs"):
+    std::vector<TcpConnection::Address> first, second;
+    for (struct addrinfo *p = error ? nullptr : list; p; p = p->ai_next)
+    {
+        if (sizeof(sockaddr_storage) < p->ai_addrlen)
+            continue;
 
-    FD_ZERO(&fdset);
-    FD_SET(sock, &fdset);
+        TcpConnection::Address address;
+        address.family = p->ai_family;
+        address.length = p->ai_addrlen;
+        memcpy(&address.storage, p->ai_addr, p->ai_addrlen);
+        if (first.empty() || first[0].family == p->ai_family)
+            first.push_back(address);
+        else
+            second.push_back(address);
+    }
+    if (!error)
+        freeaddrinfo(list);
 
-    if (select(sock + 1, NULL, &fdset, NULL, tv) > 0)
+    std::lock_guard<std::mutex> lock(lookup->mutex);
+    for (size_t i = 0; i < first.size() || i < second.size(); ++i)
     {
-        getsockopt(sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
-        if (so_error == 0)
-            goto exit;
+        if (i < first.size())
+            lookup->addresses.push_back(first[i]);
+        if (i < second.size())
+            lookup->addresses.push_back(second[i]);
     }
-    return -1;
+    lookup->done = true;
+    if (lookup->onDone)
+        lookup->onDone();
+}
 
-exit:
-    if (fcntl(sock, F_SETFL, flags) < 0)
-        return -1;
-    return 0;
+/**
+ * Converts a deadline into a sleep time, rounding up so we don't wake early.
+ */
+static std::chrono::milliseconds
+sleepUntil(std::chrono::steady_clock::time_point when,
+           std::chrono::steady_clock::time_point now)
+{
+    const auto out = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         when - now) + std::chrono::milliseconds(1);
+    return std::max(out, std::chrono::milliseconds(1));
 }
 
 TcpConnection::~TcpConnection()
 {
+    if (lookup_)
+    {
+        std::lock_guard<std::mutex> lock(lookup_->mutex);
+        lookup_->onDone = nullptr;
+    }
     if (0 < fd_)
         close(fd_);
+    for (auto fd: attempts_)
+        close(fd);
 }
 
 TcpConnection::TcpConnection():
@@ -62,74 +113,195 @@ TcpConnection::TcpConnection():
 }
 
 Status
-TcpConnection::connect(const std::string &hostname, unsigned port)
+TcpConnection::connect(const std::string &hostname, unsigned port,
+                       const std::function<void ()> &onLookup)
 {
-    // Do the DNS lookup:
-    struct addrinfo hints {};
-    struct addrinfo *list = nullptr;
-    hints.ai_family = AF_UNSPEC; // Allow IPv6 or IPv4
-    hints.ai_socktype = SOCK_STREAM; // TCP only
-    if (getaddrinfo(hostname.c_str(), std::to_string(port).c_str(), &hints, &list))
-        return ABC_ERROR(ABC_CC_ServerError, "Cannot look up " + hostname);
+    hostname_ = hostname;
+    deadline_ = std::chrono::steady_clock::now() + connectTimeout;
+
+    // The lookup can take forever, so it gets its own thread.
+    // If we give up first, the thread cleans up after itself:
+    lookup_ = std::make_shared<Lookup>();
+    lookup_->onDone = onLookup;
+    std::thread(lookupTask, lookup_, hostname, port).detach();
+
+    return Status();
+}
 
-    // Try the returned DNS entries until one connects:
-    for (struct addrinfo *p = list; p; ++p)
+Status
+TcpConnection::wakeup(std::chrono::milliseconds &sleep)
+{
+    sleep = std::chrono::milliseconds(0);
+    if (connected())
+        return Status();
+    if (!lookup_)
+        return ABC_ERROR(ABC_CC_ServerError, "Not connected");
+
+    const auto now = std::chrono::steady_clock::now();
+    if (deadline_ < now)
+        return ABC_ERROR(ABC_CC_ServerError, "Cannot connect to " + hostname_);
+
+    // Wait for the DNS lookup, which wakes us up once it finishes:
+    if (addresses_.empty())
     {
-        fd_ = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (fd_ < 0)
+        std::lock_guard<std::mutex> lock(lookup_->mutex);
+        if (!lookup_->done)
         {
-            freeaddrinfo(list);
-            return ABC_ERROR(ABC_CC_ServerError, "Cannot create socket to " + hostname);
+            sleep = sleepUntil(deadline_, now);
+            return Status();
         }
+        if (lookup_->addresses.empty())
+            return ABC_ERROR(ABC_CC_ServerError, "Cannot look up " + hostname_);
 
-        struct timeval sto;
-        sto.tv_sec = 10;
-        sto.tv_usec = 0;
-        if (0 == timeoutConnect(fd_, p->ai_addr, p->ai_addrlen, &sto))
-            break;
+        addresses_ = lookup_->addresses;
+        nextAttempt_ = now;
+    }
 
-        close(fd_);
-        fd_ = 0;
+    // Check the attempts in progress:
+    std::vector<struct ::pollfd> fds;
+    for (auto fd: attempts_)
+        fds.push_back(::pollfd{ fd, POLLOUT, 0 });
+    if (!fds.empty() && 0 < poll(fds.data(), fds.size(), 0))
+    {
+        for (const auto &p: fds)
+        {
+            if (!p.revents)
+                continue;
+
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            attempts_.erase(std::find(attempts_.begin(), attempts_.end(), p.fd));
+            if (!error && !fd_)
+            {
+                // The winner:
+                fd_ = p.fd;
+            }
+            else
+            {
+                // Don't wait to try the next address:
+                close(p.fd);
+                nextAttempt_ = now;
+            }
+        }
+    }
+    if (connected())
+    {
+        for (auto fd: attempts_)
+            close(fd);
+        attempts_.clear();
+        return Status();
     }
-    freeaddrinfo(list);
 
-    if (fd_ < 0)
-        return ABC_ERROR(ABC_CC_ServerError, "Cannot connect to " + hostname);
+    // Start another attempt if the others are taking too long:
+    if (nextAttempt_ <= now && nextAddress_ < addresses_.size())
+    {
+        attemptStart();
+        nextAttempt_ = now + attemptDelay;
+        if (connected())
+            return Status();
+    }
+    if (attempts_.empty() && addresses_.size() <= nextAddress_)
+        return ABC_ERROR(ABC_CC_ServerError, "Cannot connect to " + hostname_);
 
+    // The attempts wake us once they finish,
+    // so we only need the timer for the next attempt or the deadline:
+    sleep = sleepUntil(deadline_, now);
+    if (nextAddress_ < addresses_.size())
+        sleep = std::min(sleep, sleepUntil(nextAttempt_, now));
     return Status();
 }
 
+void
+TcpConnection::attemptStart()
+{
+    const auto &address = addresses_[nextAddress_++];
+
+    int fd = socket(address.family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return;
+
+    // A stalled server must never block the watcher thread:
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        close(fd);
+        return;
+    }
+
+    if (0 == ::connect(fd,
+                       reinterpret_cast<const struct sockaddr *>(&address.storage),
+                       address.length))
+        fd_ = fd;
+    else if (EINPROGRESS == errno)
+        attempts_.push_back(fd);
+    else
+        close(fd);
+}
+
 Status
 TcpConnection::send(DataSlice data)
 {
-    while (data.size())
+    outgoing_.insert(outgoing_.end(), data.begin(), data.end());
+    return flush();
+}
+
+Status
+TcpConnection::flush()
+{
+    if (!connected())
+        return Status();
+
+    size_t sent = 0;
+    while (sent < outgoing_.size())
     {
-        auto bytes = ::send(fd_, data.data(), data.size(), 0);
+        auto bytes = ::send(fd_, outgoing_.data() + sent,
+                            outgoing_.size() - sent, 0);
         if (bytes < 0)
-            return ABC_ERROR(ABC_CC_ServerError, "Failed to send");
+        {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN != errno && EWOULDBLOCK != errno)
+                return ABC_ERROR(ABC_CC_ServerError, "Failed to send");
 
-        data = DataSlice(data.data() + bytes, data.end());
+            // The socket is full, so try again once it is writable:
+            break;
+        }
+        sent += bytes;
     }
 
+    outgoing_.erase(outgoing_.begin(), outgoing_.begin() + sent);
     return Status();
 }
 
 Status
-TcpConnection::read(DataChunk &result)
+TcpConnection::read(DataChunk &buffer)
 {
-    unsigned char data[1024];
-    auto bytes = recv(fd_, data, sizeof(data), MSG_DONTWAIT);
-    if (bytes < 0)
+    while (true)
     {
-        if (EAGAIN != errno && EWOULDBLOCK != errno)
-            return ABC_ERROR(ABC_CC_ServerError, "Cannot read from socket");
+        // Receive straight into the end of the buffer:
+        const auto used = buffer.size();
+        buffer.resize(used + readSize);
+        auto bytes = recv(fd_, buffer.data() + used, readSize, MSG_DONTWAIT);
+        buffer.resize(used + (0 < bytes ? bytes : 0));
 
-        // No data, but that's fine:
-        bytes = 0;
-    }
+        if (bytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN != errno && EWOULDBLOCK != errno)
+                return ABC_ERROR(ABC_CC_ServerError, "Cannot read from socket");
 
-    result = DataChunk(data, data + bytes);
-    return Status();
+            // No more data, but that's fine:
+            return Status();
+        }
+        if (0 == bytes)
+            return ABC_ERROR(ABC_CC_ServerError, "Connection closed");
+
+        // A short read means the socket is empty, so skip the extra call:
+        if (static_cast<size_t>(bytes) < readSize)
+            return Status();
+    }
 }
 
 } // namespace abcd
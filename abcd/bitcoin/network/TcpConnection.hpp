@@ -10,6 +10,11 @@
 
 #include "../../util/Status.hpp"
 #include "../../util/Data.hpp"
+#include <sys/socket.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace abcd {
 
@@ -20,30 +25,95 @@ public:
     TcpConnection();
 
     /**
-     * Connect to the specified server.
+     * Begins connecting to the specified server.
+     * The DNS lookup happens on a background thread,
+     * and `wakeup` finishes the job without ever blocking.
+     * @param onLookup called from the DNS thread once the lookup is done,
+     * but never after this object is gone.
      */
     Status
-    connect(const std::string &hostname, unsigned port);
+    connect(const std::string &hostname, unsigned port,
+            const std::function<void ()> &onLookup);
 
     /**
-     * Send some data over the socket.
+     * Advances a connection that is still being set up,
+     * racing the server's addresses against each other.
+     * @param sleep the time until the next wakeup is needed,
+     * or zero once the connection is up.
+     * @return an error if every address has failed, or time has run out.
+     */
+    Status
+    wakeup(std::chrono::milliseconds &sleep);
+
+    /**
+     * Returns true once the socket is ready for use.
+     */
+    bool connected() const { return 0 < fd_; }
+
+    /**
+     * Queues some data for the socket, and writes as much as it will take.
+     * Never blocks; call `flush` once the socket is writable to continue.
      */
     Status
     send(DataSlice data);
 
     /**
-     * Read all pending data from the socket (might not produce anything).
+     * Writes as much of the queued data as the socket will take.
+     */
+    Status
+    flush();
+
+    /**
+     * Returns the number of bytes waiting for the socket to become writable.
+     */
+    size_t
+    sendPending() const { return outgoing_.size(); }
+
+    /**
+     * Drains all pending data from the socket,
+     * appending it to the end of the buffer (might not produce anything).
      */
     Status
-    read(DataChunk &result);
+    read(DataChunk &buffer);
 
     /**
      * Obtains a list of sockets that the main loop should sleep on.
      */
     int pollfd() const { return fd_; }
 
+    /**
+     * Obtains the sockets with connections in progress,
+     * which become writable once their attempts finish.
+     */
+    const std::vector<int> &pollConnecting() const { return attempts_; }
+
+    // Connection-setup details, shared with the DNS thread:
+    struct Address
+    {
+        int family;
+        socklen_t length;
+        sockaddr_storage storage;
+    };
+    struct Lookup;
+
 private:
     int fd_;
+    DataChunk outgoing_;
+
+    // Connection setup:
+    std::string hostname_;
+    std::shared_ptr<Lookup> lookup_; // Shared with the DNS thread
+    std::vector<Address> addresses_;
+    size_t nextAddress_ = 0;
+    std::vector<int> attempts_; // Sockets with connections in progress
+    std::chrono::steady_clock::time_point nextAttempt_;
+    std::chrono::steady_clock::time_point deadline_;
+
+    /**
+     * Starts a non-blocking connection to the next address.
+     */
+    void
+    attemptStart();
 };
 
 } // namespace abcd
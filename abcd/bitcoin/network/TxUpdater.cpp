@@ -6,27 +6,43 @@
  */
 
 #include "TxUpdater.hpp"
-#include "LibbitcoinConnection.hpp"
-#include "StratumConnection.hpp"
+#include "ConnectionPool.hpp"
+#include "IBitcoinConnection.hpp"
 #include "../cache/Cache.hpp"
-#include "../../General.hpp"
 #include "../../util/Debug.hpp"
+#include "../../../minilibs/libbitcoin-client/client.hpp"
 #include <sys/time.h>
 
 namespace abcd {
 
-constexpr auto NUM_CONNECT_SERVERS = 5;
-constexpr auto MINIMUM_AIRBITZ_SERVERS = 1;
-constexpr auto MINIMUM_STRATUM_SERVERS = 4;
-constexpr auto AIRBITZ_DOMAIN = ".airbitz.co:";
+// Hedge a fetch once it takes longer than this fraction of replies,
+// but never sooner than the minimum:
+constexpr double hedgePercentile = 0.95;
+constexpr unsigned hedgeSamples = 10;
+constexpr std::chrono::milliseconds hedgeMinimum(500);
+
+/**
+ * Wraps a callback so it does nothing once its owner is gone.
+ */
+template<typename... Args>
+static std::function<void (Args...)>
+guard(std::weak_ptr<bool> alive, std::function<void (Args...)> f)
+{
+    return [alive, f](Args... args)
+    {
+        if (alive.lock())
+            f(args...);
+    };
+}
 
 TxUpdater::~TxUpdater()
 {
-    disconnect();
+    pool_.remove(*this);
 }
 
-TxUpdater::TxUpdater(Wallet &wallet, void *ctx):
+TxUpdater::TxUpdater(Wallet &wallet, ConnectionPool &pool):
     cache_(wallet.cache),
+    pool_(pool),
     overrideBitcoinServers_(wallet.bOverrideBitcoinServers),
     overrideBitcoinServerList_(wallet.overrideBitcoinServerList)
 {
@@ -35,142 +51,22 @@ TxUpdater::TxUpdater(Wallet &wallet, void *ctx):
 void
 TxUpdater::disconnect()
 {
+    // The pool drops the connections once no wallet wants them:
     wantConnection = false;
-
-    auto i = connections_.begin();
-    while (i != connections_.end())
-    {
-        delete *i;
-        i = connections_.erase(i);
-    }
-
-    ABC_DebugLog("Disconnected from all servers.");
-}
-
-static bool
-checkIfAirbitzServer(std::string str)
-{
-    std::string suffix = AIRBITZ_DOMAIN;
-
-    if (str.find(suffix) != std::string::npos)
-    {
-        return true;
-    }
-    else
-    {
-        return false;
-    }
 }
 
 Status
 TxUpdater::connect()
 {
     wantConnection = true;
-
-    if (overrideBitcoinServers_)
-    {
-        stratumServers_ = overrideBitcoinServerList_;
-    }
-    else
-    {
-        // If we are out of fresh stratum servers, reload the list:
-        if (stratumServers_.empty())
-            stratumServers_ = cache_.servers.getServers(ServerTypeStratum,
-                              MINIMUM_STRATUM_SERVERS * 2);
-        if (airbitzServers_.empty())
-            airbitzServers_ = cache_.servers.getServers(ServerTypeAirbitz,
-                              MINIMUM_AIRBITZ_SERVERS * 2);
-    }
-
-    for (int i = 0; i < stratumServers_.size(); i++)
-        ABC_DebugLevel(1, "stratumServers_[%d]=%s", i, stratumServers_[i].c_str());
-
-    // Count the number of existing connections:
-    size_t stratumCount = 0;
-    size_t airbitzCount = 0;
-    for (auto *bc: connections_)
-    {
-        if (dynamic_cast<StratumConnection *>(bc))
-            ++stratumCount;
-        if (checkIfAirbitzServer(bc->uri()))
-            ++airbitzCount;
-    }
-
-    // Let's make some connections:
-    srand(time(nullptr));
-    while (connections_.size() < NUM_CONNECT_SERVERS && (stratumServers_.size()
-            || airbitzServers_.size()))
-    {
-        auto *serverList = &stratumServers_;
-
-        if (stratumServers_.size())
-        {
-            // Already assigned above
-        }
-        else if (airbitzServers_.size())
-        {
-            serverList = &airbitzServers_;
-        }
-
-        auto i = serverList->begin();
-        std::advance(i, rand() % serverList->size());
-
-        bool bAirbitzServer = checkIfAirbitzServer(*i);
-
-        // If the number of Airbitz servers we need equals the number of server slots left, then do not connect
-        // to non-Airbitz servers (only have this restriction if overrideBitcoinServers_ is false.
-        if (!overrideBitcoinServers_)
-        {
-            if (NUM_CONNECT_SERVERS - connections_.size() <= (MINIMUM_AIRBITZ_SERVERS -
-                    airbitzCount))
-            {
-                if (!bAirbitzServer)
-                {
-                    serverList->erase(i);
-                    continue;
-                }
-            }
-        }
-        if (connectTo(*i, ServerTypeStratum).log())
-        {
-            stratumCount++;
-            if (bAirbitzServer)
-                airbitzCount++;
-        }
-        else
-        {
-            cache_.servers.serverScoreDown(*i);
-        }
-        serverList->erase(i);
-    }
-
     return Status();
 }
 
 std::chrono::milliseconds
 TxUpdater::wakeup()
 {
-    // Handle any old work that has finished:
-    std::chrono::milliseconds nextWakeup(0);
-    for (auto *bc: connections_)
-    {
-        auto *sc = dynamic_cast<StratumConnection *>(bc);
-        if (sc)
-        {
-            SleepTime sleep;
-            if (!sc->wakeup(sleep).log())
-                failedServers_.insert(bc->uri());
-            else
-            {
-                cache_.servers.serverScoreUp(bc->uri(), 0);
-                nextWakeup = bc::client::min_sleep(nextWakeup, sleep);
-            }
-        }
-
-        auto *lc = dynamic_cast<LibbitcoinConnection *>(bc);
-        if (lc)
-            nextWakeup = bc::client::min_sleep(nextWakeup, lc->wakeup());
-    }
+    // Duplicate any fetches that are taking too long:
+    auto nextWakeup = hedgeSend();
 
     // Fetch missing transactions:
     time_t sleep;
@@ -181,7 +77,8 @@ TxUpdater::wakeup()
         for (const auto &txid: status.missingTxids)
         {
             // Try to use the same server:
-            auto *bc = pickServer(addressServers_[status.address]);
+            auto *bc = pool_.pickServer(addressServers_[status.address],
+                                        ServerRequestTx);
             if (!bc)
                 break;
 
@@ -195,19 +92,27 @@ TxUpdater::wakeup()
         if (status.dirty)
         {
             // Try to use the same server that made us dirty:
-            auto *bc = pickServer(addressServers_[status.address]);
+            auto *bc = pool_.pickServer(addressServers_[status.address],
+                                        ServerRequestAddress);
             if (!bc)
                 break;
 
             if (bc->addressSubscribed(status.address))
+            {
+                // Another wallet might have made the subscription:
+                pool_.addressWatch(*this, status.address);
                 fetchAddress(status.address, bc);
+            }
             else
+            {
                 subscribeAddress(status.address, bc);
+            }
         }
         else if (status.needsCheck)
         {
             // Try to use a different server than last time:
-            auto *bc = pickOtherServer(addressServers_[status.address]);
+            auto *bc = pool_.pickOtherServer(ServerRequestAddress,
+                                             addressServers_[status.address]);
             if (!bc)
                 break;
 
@@ -215,294 +120,93 @@ TxUpdater::wakeup()
         }
     }
 
-    // Grab block headers that we don't have:
-    while (true)
-    {
-        size_t headerNeeded = cache_.blocks.headerNeeded();
-        if (!headerNeeded)
-            break;
-
-        auto *bc = pickOtherServer();
-        if (!bc)
-            break;
-
-        blockHeaderFetch(headerNeeded, bc);
-    }
-    cache_.blocks.save();
-    cache_.blocks.onHeaderInvoke();
-    cache_.servers.serverCacheSave();
-
-    // Save the cache if it is dirty and enough time has elapsed:
-    if (cacheDirty)
-    {
-        time_t now = time(nullptr);
-
-        if (10 <= now - cacheLastSave)
-        {
-            cache_.save().log(); // Failure is fine
-            cacheLastSave = now;
-            cacheDirty = false;
-        }
-    }
-
-    // Prune failed servers:
-    for (const auto &uri: failedServers_)
-    {
-        auto i = connections_.begin();
-        while (i != connections_.end())
-        {
-            auto *bc = *i;
-            if (uri == bc->uri())
-            {
-                ABC_DebugLog("Disconnecting from %s", bc->uri().c_str());
-                cache_.servers.serverScoreDown(bc->uri());
-                delete bc;
-                i = connections_.erase(i);
-            }
-            else
-            {
-                ++i;
-            }
-        }
-    }
-    failedServers_.clear();
-
-    // Connect to more servers:
-    if (wantConnection && connections_.size() < NUM_CONNECT_SERVERS)
-        connect().log();
+    // Publish anything this round changed without a callback,
+    // such as new block heights:
+    cache_.txs.snapshotPublish();
 
     return nextWakeup;
 }
 
-std::list<zmq_pollitem_t>
-TxUpdater::pollitems()
+bool
+TxUpdater::saveDue()
 {
-    std::list<zmq_pollitem_t> out;
-    for (auto *bc: connections_)
-    {
-        auto *sc = dynamic_cast<StratumConnection *>(bc);
-        if (sc)
-        {
-            zmq_pollitem_t pollitem =
-            {
-                nullptr, sc->pollfd(), ZMQ_POLLIN, ZMQ_POLLOUT
-            };
-            out.push_back(pollitem);
-        }
-
-        auto *lc = dynamic_cast<LibbitcoinConnection *>(bc);
-        if (lc)
-            out.push_back(lc->pollitem());
-    }
-    return out;
-}
+    // Save the cache if it is dirty and enough time has elapsed:
+    if (!cacheDirty)
+        return false;
 
-void
-TxUpdater::sendTx(StatusCallback status, DataSlice tx)
-{
-    for (auto *bc: connections_)
-    {
-        // Pick one (and only one) stratum server for the broadcast:
-        auto *sc = dynamic_cast<StratumConnection *>(bc);
-        if (sc)
-        {
-            sc->sendTx(status, tx);
-            return;
-        }
-    }
+    time_t now = time(nullptr);
+    if (now - cacheLastSave < 10)
+        return false;
 
-    // If we get here, there are no stratum connections:
-    status(ABC_ERROR(ABC_CC_Error, "No stratum connections"));
+    cacheLastSave = now;
+    cacheDirty = false;
+    return true;
 }
 
-Status
-TxUpdater::connectTo(std::string server, ServerType serverType)
+void
+TxUpdater::saveSoon()
 {
-    std::string key;
-
-    // Parse out the key part:
-    size_t keyStart = server.find(' ');
-    if (keyStart != std::string::npos)
-    {
-        key = server.substr(keyStart + 1);
-        server.erase(keyStart);
-    }
-
-    // Make the connection:
-    std::unique_ptr<IBitcoinConnection> bc;
-    if (ServerTypeStratum == serverType)
-    {
-        // Stratum server:
-        std::unique_ptr<StratumConnection> sc(new StratumConnection());
-        ABC_CHECK(sc->connect(server));
-        bc.reset(sc.release());
-    }
-    else
-    {
-        return ABC_ERROR(ABC_CC_Error, "Unknown server type " + server);
-    }
-
-    // Height callbacks:
-    subscribeHeight(bc.get());
-
-    // Check for mining fees:
-    auto sc = dynamic_cast<StratumConnection *>(bc.get());
-    if (generalEstimateFeesNeedUpdate() && sc)
-    {
-        fetchFeeEstimate(1, sc);
-        fetchFeeEstimate(2, sc);
-        fetchFeeEstimate(3, sc);
-        fetchFeeEstimate(4, sc);
-        fetchFeeEstimate(5, sc);
-        fetchFeeEstimate(6, sc);
-        fetchFeeEstimate(7, sc);
-    }
-
-    connections_.push_back(bc.release());
-    ABC_DebugLog("Connected to %s as %d", server.c_str(), index);
-
-    return Status();
+    cacheDirty = true;
+    cacheLastSave = 0;
 }
 
-IBitcoinConnection *
-TxUpdater::pickServer(const std::string &name)
+void
+TxUpdater::heightChanged()
 {
-    // If the requested server is connected, only consider that:
-    for (auto *bc: connections_)
-        if (name == bc->uri() && !failedServers_.count(bc->uri()))
-            return bc->queueFull() ? nullptr : bc;
-
-    // Otherwise, use any server:
-    return pickOtherServer();
+    cache_.addresses.updateHeight();
 }
 
-IBitcoinConnection *
-TxUpdater::pickOtherServer(const std::string &name)
+void
+TxUpdater::sendTx(StatusCallback status, DataSlice tx)
 {
-    IBitcoinConnection *fallback = nullptr;
-
-    for (auto *bc: connections_)
-    {
-        if (!bc->queueFull() && !failedServers_.count(bc->uri()))
-        {
-            if (name != bc->uri())
-                return bc; // Just what we want!
-            else
-                fallback = bc; // Not our first choice, but tolerable.
-        }
-    }
-
-    return fallback;
+    pool_.sendTx(status, tx);
 }
 
 void
-TxUpdater::subscribeHeight(IBitcoinConnection *bc)
+TxUpdater::subscribeAddress(const std::string &address, IBitcoinConnection *bc)
 {
-    const auto uri = bc->uri();
-    auto onError = [this, uri](Status s)
-    {
-        ABC_DebugLog("%s: height subscribe failed (%s)",
-                     uri.c_str(), s.message().c_str());
-        failedServers_.insert(uri);
-    };
-
-    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
-
-    auto onReply = [this, uri, queryTime](size_t height)
-    {
-        // Set the response time in the cache
-        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
-        cache_.servers.setResponseTime(uri, responseTime - queryTime);
-
-        ABC_DebugLog("%s: height %d returned %d ms", uri.c_str(), height,
-                     responseTime - queryTime);
-        size_t oldHeight = cache_.blocks.heightSet(height);
-
-        if (oldHeight > height + 2)
-        {
-            // This server is behind in block height. Disconnect then penalize it a lot
-            cache_.servers.serverScoreDown(uri, 20);
-        }
-        else if (oldHeight <= height)
-        {
-            cache_.servers.serverScoreUp(uri); // Point for returning a valid height
-            if (oldHeight < height)
-            {
-                cache_.servers.serverScoreUp(uri); // Point for returning a newer height
-
-
-                // Update addresses with unconfirmed txs:
-                const auto statuses = cache_.txs.statuses(cache_.addresses.txids());
-                for (const auto status: statuses)
-                {
-                    if (!status.second.height)
-                    {
-                        for (const auto &io: status.first.ios)
-                        {
-                            ABC_DebugLog("Marking %s dirty (tx height check)",
-                                         io.address.c_str());
-                            cache_.addresses.updateStratumHash(io.address);
-                        }
-                    }
-                }
-            }
-        }
-    };
-
-    bc->heightSubscribe(onError, onReply);
+    // The pool shares the subscription with any other wallets:
+    pool_.addressSubscribe(*this, address, bc);
 }
 
-void
-TxUpdater::subscribeAddress(const std::string &address, IBitcoinConnection *bc)
+bool
+TxUpdater::addressHash(const std::string &address, const std::string &uri,
+                       const std::string &stateHash)
 {
-    // If we are already subscribed, mark the address as up-to-date:
-    if (bc->addressSubscribed(address))
+    if (cache_.addresses.updateStratumHash(address, stateHash))
     {
-        cache_.addresses.updateSubscribe(address);
-        return;
+        addressServers_[address] = uri;
+        ABC_DebugLog("%s: %s subscribe reply (dirty) %s",
+                     uri.c_str(), address.c_str(), stateHash.c_str());
+        return true;
     }
 
-    const auto uri = bc->uri();
-    auto onError = [this, address, uri](Status s)
-    {
-        ABC_DebugLog("%s: %s subscribe failed (%s)",
-                     uri.c_str(), address.c_str(), s.message().c_str());
-        failedServers_.insert(uri);
-    };
-
-    auto onReply = [this, address, uri](const std::string &stateHash)
-    {
-        if (cache_.addresses.updateStratumHash(address, stateHash))
-        {
-            cache_.servers.serverScoreUp(uri); // Point for returning a new hash
-            addressServers_[address] = uri;
-            ABC_DebugLog("%s: %s subscribe reply (dirty) %s",
-                         uri.c_str(), address.c_str(), stateHash.c_str());
-        }
-        else
-        {
-            ABC_DebugLog("%s: %s subscribe reply (clean) %s",
-                         uri.c_str(), address.c_str(), stateHash.c_str());
-        }
-    };
-
-    bc->addressSubscribe(onError, onReply, address);
+    ABC_DebugLog("%s: %s subscribe reply (clean) %s",
+                 uri.c_str(), address.c_str(), stateHash.c_str());
+    return false;
 }
 
 void
-TxUpdater::fetchAddress(const std::string &address, IBitcoinConnection *bc)
+TxUpdater::fetchAddress(const std::string &address, IBitcoinConnection *bc,
+                        bool hedge)
 {
-    if (wipAddresses_.count(address))
+    if (!hedge && wipAddresses_.count(address))
         return;
-    wipAddresses_.insert(address);
+    ++wipAddresses_[address];
 
     const auto uri = bc->uri();
     auto onError = [this, address, uri](Status s)
     {
         ABC_DebugLog("%s: %s fetch failed (%s)",
                      uri.c_str(), address.c_str(), s.message().c_str());
-        failedServers_.insert(uri);
-        wipAddresses_.erase(address);
+        if (!isRequestTimeout(s))
+            pool_.fail(uri);
+        cache_.servers.setResponseError(uri, ServerRequestAddress);
+
+        // The other copy might still come through:
+        auto wip = wipAddresses_.find(address);
+        if (wipAddresses_.end() != wip && !--wip->second)
+            wipAddresses_.erase(wip);
     };
 
     unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
@@ -510,18 +214,27 @@ TxUpdater::fetchAddress(const std::string &address, IBitcoinConnection *bc)
     auto onReply = [this, address, uri, queryTime](const AddressHistory &history)
     {
         unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
-        cache_.servers.setResponseTime(uri, responseTime - queryTime);
+        cache_.servers.setResponseTime(uri, responseTime - queryTime,
+                                       ServerRequestAddress);
 
+        // The first reply wins:
+        if (!wipAddresses_.erase(address))
+            return;
         ABC_DebugLog("%s: %s fetched %d TXIDs %d ms", uri.c_str(), address.c_str(),
                      history.size(), responseTime - queryTime);
-        wipAddresses_.erase(address);
         addressServers_[address] = uri;
 
         TxidSet txids;
         for (auto &row: history)
-        {
-            cache_.txs.confirmed(row.first, row.second);
             txids.insert(row.first);
+
+        // Only apply the heights that changed:
+        const auto heights = cache_.txs.heights(txids);
+        for (auto &row: history)
+        {
+            const auto i = heights.find(row.first);
+            if (heights.end() == i || i->second != row.second)
+                cache_.txs.confirmed(row.first, row.second);
         }
 
         if (!history.empty())
@@ -544,29 +257,51 @@ TxUpdater::fetchAddress(const std::string &address, IBitcoinConnection *bc)
                 ABC_DebugLog("%s: %s SERVER ERROR EMPTY TXIDs with hash %s", uri.c_str(),
                              address.c_str(), hash.c_str());
                 // Do not trust current server. Force a new server.
-                failedServers_.insert(uri);
+                pool_.fail(uri);
                 cache_.servers.serverScoreDown(uri, 20);
             }
         }
     };
 
-    bc->addressHistoryFetch(onError, onReply, address);
+    bc->addressHistoryFetch(guard(alive_, StatusCallback(onError)),
+                           guard(alive_, AddressCallback(onReply)),
+                           address);
+    if (!hedge)
+        hedgeSchedule(ServerRequestAddress, address, uri);
 }
 
 void
-TxUpdater::fetchTx(const std::string &txid, IBitcoinConnection *bc)
+TxUpdater::fetchTx(const std::string &txid, IBitcoinConnection *bc,
+                   bool hedge)
 {
-    if (wipTxids_.count(txid))
-        return;
-    wipTxids_.insert(txid);
+    if (!hedge)
+    {
+        if (wipTxids_.count(txid))
+            return;
+
+        // Another wallet might have fetched this already:
+        if (cache_.txs.insertStored(txid))
+        {
+            cache_.addresses.updateTx(txid);
+            cacheDirty = true;
+            return;
+        }
+    }
+    ++wipTxids_[txid];
 
     const auto uri = bc->uri();
     auto onError = [this, txid, uri](Status s)
     {
         ABC_DebugLog("%s: tx %s fetch failed (%s)",
                      uri.c_str(), txid.c_str(), s.message().c_str());
-        failedServers_.insert(uri);
-        wipTxids_.erase(txid);
+        if (!isRequestTimeout(s))
+            pool_.fail(uri);
+        cache_.servers.setResponseError(uri, ServerRequestTx);
+
+        // The other copy might still come through:
+        auto wip = wipTxids_.find(txid);
+        if (wipTxids_.end() != wip && !--wip->second)
+            wipTxids_.erase(wip);
     };
 
     unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
@@ -574,72 +309,91 @@ TxUpdater::fetchTx(const std::string &txid, IBitcoinConnection *bc)
     auto onReply = [this, txid, uri, queryTime](const bc::transaction_type &tx)
     {
         unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
-        cache_.servers.setResponseTime(uri, responseTime - queryTime);
+        cache_.servers.setResponseTime(uri, responseTime - queryTime,
+                                       ServerRequestTx);
+
+        // A server that sends the wrong transaction can't be trusted,
+        // so leave the request open for the other copy:
+        if (bc::encode_hash(bc::hash_transaction(tx)) != txid)
+        {
+            ABC_DebugLog("%s: tx %s has the wrong hash",
+                         uri.c_str(), txid.c_str());
+            cache_.servers.setResponseError(uri, ServerRequestTx);
+            cache_.servers.serverScoreDown(uri, 20);
+            auto wip = wipTxids_.find(txid);
+            if (wipTxids_.end() != wip && !--wip->second)
+                wipTxids_.erase(wip);
+            return;
+        }
 
+        // The first reply wins:
+        if (!wipTxids_.erase(txid))
+            return;
         ABC_DebugLog("%s: tx %s fetched", uri.c_str(), txid.c_str());
-        wipTxids_.erase(txid);
 
         cache_.txs.insert(tx, txid);
-        cache_.addresses.update();
+        cache_.addresses.updateTx(txid);
         cacheDirty = true;
         cache_.servers.serverScoreUp(uri);
     };
 
     ABC_DebugLog("%s: tx %s requested", uri.c_str(), txid.c_str());
-    bc->txDataFetch(onError, onReply, txid);
+    bc->txDataFetch(guard(alive_, StatusCallback(onError)),
+                    guard(alive_, TxCallback(onReply)),
+                    txid);
+    if (!hedge)
+        hedgeSchedule(ServerRequestTx, txid, uri);
 }
 
 void
-TxUpdater::fetchFeeEstimate(size_t blocks, StratumConnection *sc)
+TxUpdater::hedgeSchedule(ServerRequest request, const std::string &key,
+                         const std::string &uri)
 {
-    const auto uri = sc->uri();
-    auto onError = [this, blocks, uri](Status s)
-    {
-        ABC_DebugLog("%s: get fees for %d blocks failed (%s)",
-                     uri.c_str(), blocks, s.message().c_str());
-    };
+    // Use the server's own tail latency if we know it:
+    const auto latency = cache_.servers.latency(uri, request);
+    const unsigned long long ms = hedgeSamples <= latency.samples ?
+                                  latency.percentile(hedgePercentile) :
+                                  2 * cache_.servers.expectedResponseTime(uri, request);
+    const auto delay = std::max(std::chrono::milliseconds(ms), hedgeMinimum);
 
-    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
-    auto onReply = [this, blocks, uri, queryTime](double fee)
+    hedges_.push(Hedge
     {
-        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
-        cache_.servers.setResponseTime(uri, responseTime - queryTime);
-
-        ABC_DebugLog("%s: returned fee %lf for %d blocks %d ms",
-                     uri.c_str(), fee, blocks, responseTime - queryTime);
-        generalEstimateFeesUpdate(blocks, fee);
-    };
-
-    sc->feeEstimateFetch(onError, onReply, blocks);
+        std::chrono::steady_clock::now() + delay, request, key, uri
+    });
 }
 
-void
-TxUpdater::blockHeaderFetch(size_t height, IBitcoinConnection *bc)
+std::chrono::milliseconds
+TxUpdater::hedgeSend()
 {
-    const auto uri = bc->uri();
-    auto onError = [this, height, uri](Status s)
-    {
-        ABC_DebugLog("%s: header %d fetch failed (%s)",
-                     uri.c_str(), height, s.message().c_str());
-        failedServers_.insert(uri);
-    };
-
-    unsigned long long queryTime = ServerCache::getCurrentTimeMilliSeconds();
-    auto onReply = [this, height, uri,
-                          queryTime](const bc::block_header_type &header)
-    {
-        unsigned long long responseTime = ServerCache::getCurrentTimeMilliSeconds();
-        cache_.servers.setResponseTime(uri, responseTime - queryTime);
-
-        ABC_DebugLog("%s: header %d fetched %d ms",
-                     uri.c_str(), height, responseTime - queryTime);
-
-        bool didInsert = cache_.blocks.headerInsert(height, header);
-        if (didInsert)
-            cache_.servers.serverScoreUp(uri);
-    };
+    const auto now = std::chrono::steady_clock::now();
+    while (!hedges_.empty() && hedges_.top().deadline <= now)
+    {
+        const auto hedge = hedges_.top();
+        hedges_.pop();
+
+        // Only hedge requests that are still waiting on their first copy:
+        const auto &wip = ServerRequestTx == hedge.request ?
+                          wipTxids_ : wipAddresses_;
+        const auto i = wip.find(hedge.key);
+        if (wip.end() == i || 1 != i->second)
+            continue;
+
+        auto *bc = pool_.pickOtherServer(hedge.request, hedge.uri);
+        if (!bc || hedge.uri == bc->uri())
+            continue;
+
+        ABC_DebugLog("%s: %s is slow, hedging on %s", hedge.uri.c_str(),
+                     hedge.key.c_str(), bc->uri().c_str());
+        if (ServerRequestTx == hedge.request)
+            fetchTx(hedge.key, bc, true);
+        else
+            fetchAddress(hedge.key, bc, true);
+    }
 
-    bc->blockHeaderFetch(onError, onReply, height);
+    if (hedges_.empty())
+        return std::chrono::milliseconds(0);
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               hedges_.top().deadline - now) + std::chrono::milliseconds(1);
 }
 
 } // namespace abcd
@@ -12,24 +12,27 @@
 #include "../../util/Data.hpp"
 #include "../cache/ServerCache.hpp"
 #include "../../wallet/Wallet.hpp"
-#include <zmq.h>
 #include <chrono>
 #include <map>
+#include <memory>
+#include <queue>
 
 namespace abcd {
 
 class Cache;
+class ConnectionPool;
 class IBitcoinConnection;
-class StratumConnection;
 
 /**
  * Syncs a set of transactions with the bitcoin server.
+ * The network connections belong to the shared ConnectionPool,
+ * which calls in here from its own thread.
  */
 class TxUpdater
 {
 public:
     ~TxUpdater();
-    TxUpdater(Wallet &wallet, void *ctx);
+    TxUpdater(Wallet &wallet, ConnectionPool &pool);
 
     void disconnect();
     Status connect();
@@ -42,10 +45,25 @@ public:
     wakeup();
 
     /**
-     * Obtains a list of sockets that the main loop should sleep on.
+     * Returns true if the cache has changes that are due to be saved.
+     * The pool does the actual save once it has let go of its lock.
      */
-    std::list<zmq_pollitem_t>
-    pollitems();
+    bool
+    saveDue();
+
+    /**
+     * Makes the next `saveDue` return true,
+     * so the pool saves the cache on its next round.
+     */
+    void
+    saveSoon();
+
+    /**
+     * Re-checks the addresses with unconfirmed transactions,
+     * since a new block might have confirmed them.
+     */
+    void
+    heightChanged();
 
     /**
      * Broadcasts a transaction.
@@ -55,9 +73,14 @@ public:
     sendTx(StatusCallback status, DataSlice tx);
 
 private:
-    Status connectTo(std::string server, ServerType serverType);
+    friend class ConnectionPool;
 
     Cache &cache_;
+    ConnectionPool &pool_;
+
+    // Replies arriving after the pool lets go of us must not touch us.
+    // The pool makes a fresh one each time we join, and resets it once we leave:
+    std::shared_ptr<bool> alive_;
 
     bool wantConnection = false;
     bool cacheDirty = false;
@@ -66,16 +89,28 @@ private:
     bool overrideBitcoinServers_;
     std::vector<std::string> overrideBitcoinServerList_;
 
-    std::vector<IBitcoinConnection *> connections_;
-//    std::vector<std::string> serverList_;
-//    std::set<int> untriedLibbitcoin_;
-//    std::set<int> untriedStratum_;
-    std::vector<std::string> stratumServers_;
-    std::vector<std::string> airbitzServers_;
+    // Fetches currently in progress, with the number of requests for each:
+    std::map<std::string, unsigned> wipAddresses_;
+    std::map<std::string, unsigned> wipTxids_;
 
-    // Fetches currently in progress:
-    AddressSet wipAddresses_;
-    TxidSet wipTxids_;
+    /**
+     * A point at which a slow fetch gets a second copy on another server.
+     */
+    struct Hedge
+    {
+        std::chrono::steady_clock::time_point deadline;
+        ServerRequest request;
+        std::string key; // The address or txid
+        std::string uri; // The server with the first request
+
+        bool
+        operator>(const Hedge &other) const
+        {
+            return deadline > other.deadline;
+        }
+    };
+    std::priority_queue<Hedge, std::vector<Hedge>, std::greater<Hedge>>
+            hedges_;
 
     /**
      * The last server used to query the address.
@@ -84,44 +119,48 @@ private:
      */
     std::map<std::string, std::string> addressServers_;
 
-    /**
-     * A list of servers that have failed.
-     */
-    std::set<std::string> failedServers_;
+    void
+    subscribeAddress(const std::string &address, IBitcoinConnection *bc);
 
     /**
-     * Finds the requested server, assuming it is even connected and ready.
-     * @return The best available server,
-     * or a null pointer if the server is busy.
+     * Handles a status hash from a server subscribed to the address,
+     * whichever wallet made the subscription.
+     * @return true if the address needs fetching.
      */
-    IBitcoinConnection *
-    pickServer(const std::string &name);
+    bool
+    addressHash(const std::string &address, const std::string &uri,
+                const std::string &stateHash);
 
     /**
-     * Tries to pick a different server than the one provided.
-     * @return The best available server,
-     * or a null pointer if there are no free servers.
+     * Fetches an address history.
+     * @param hedge true to send a duplicate of a request already in flight.
      */
-    IBitcoinConnection *
-    pickOtherServer(const std::string &name="");
-
-    void
-    subscribeHeight(IBitcoinConnection *bc);
-
     void
-    subscribeAddress(const std::string &address, IBitcoinConnection *bc);
-
-    void
-    fetchAddress(const std::string &address, IBitcoinConnection *bc);
+    fetchAddress(const std::string &address, IBitcoinConnection *bc,
+                 bool hedge=false);
 
+    /**
+     * Fetches a transaction.
+     * @param hedge true to send a duplicate of a request already in flight.
+     */
     void
-    fetchTx(const std::string &txid, IBitcoinConnection *bc);
+    fetchTx(const std::string &txid, IBitcoinConnection *bc,
+            bool hedge=false);
 
+    /**
+     * Schedules a hedge for a request that was just sent,
+     * once it has taken longer than most replies from that server.
+     */
     void
-    fetchFeeEstimate(size_t blocks, StratumConnection *sc);
+    hedgeSchedule(ServerRequest request, const std::string &key,
+                  const std::string &uri);
 
-    void
-    blockHeaderFetch(size_t height, IBitcoinConnection *bc);
+    /**
+     * Sends duplicates of any requests that have missed their deadline,
+     * returning the time until the next deadline.
+     */
+    std::chrono::milliseconds
+    hedgeSend();
 };
 
 } // namespace abcd
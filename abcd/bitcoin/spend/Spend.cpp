@@ -98,7 +98,7 @@ Status
 Spend::calculateMax(uint64_t &maxSatoshi, bool skipUnconfirmed)
 {
     const auto addresses = wallet_.addresses.list();
-    const auto utxos = wallet_.cache.txs.utxos(addresses);
+    const auto utxos = wallet_.cache.txs.snapshot()->utxos(addresses);
     const auto info = generalAirbitzFeeInfo();
 
     // Set up a fake transaction:
@@ -337,7 +337,7 @@ Spend::makeTx(libbitcoin::transaction_type &result,
 
     // Check if enough confirmed inputs are available:
     uint64_t fee, change;
-    auto utxos = wallet_.cache.txs.utxos(wallet_.addresses.list());
+    auto utxos = wallet_.cache.txs.snapshot()->utxos(wallet_.addresses.list());
     const auto s = inputsPickOptimal(fee, change, tx, filterOutputs(utxos, true),
                                      feeLevel_, customFeeSatoshi_);
 
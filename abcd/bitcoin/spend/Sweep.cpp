@@ -28,7 +28,7 @@ sweepSend(Wallet &wallet,
     // Find utxos for this address:
     AddressSet addresses;
     addresses.insert(address);
-    auto utxos = wallet.cache.txs.utxos(addresses);
+    auto utxos = wallet.cache.txs.snapshot()->utxos(addresses);
 
     // Bail out if there are no funds to sweep:
     if (!utxos.size())
@@ -96,8 +96,9 @@ sweepSend(Wallet &wallet,
 
     // Update the transaction cache:
     wallet.cache.txs.insert(tx, info.txid);
+    // This runs inside the address cache callbacks,
+    // so the caller saves the cache once the lock is free:
     wallet.cache.addresses.updateSpend(info);
-    wallet.cache.save().log(); // Failure is fine
 
     // Done:
     ABC_DebugLog("IncomingSweep callback: wallet %s, txid: %s, value: %d",
@@ -17,6 +17,7 @@ class Wallet;
 /**
  * Sweeps the funds from an address into the wallet.
  * Requires that the address has been fully synced into the cache.
+ * The caller needs to save the cache afterwards.
  */
 void
 sweepOnComplete(Wallet &wallet,
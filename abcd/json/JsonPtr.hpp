@@ -69,6 +69,12 @@ public:
     Status
     decode(const std::string &data);
 
+    /**
+     * Loads the JSON object from an in-memory buffer, without copying it.
+     */
+    Status
+    decode(const char *data, size_t size);
+
     /**
      * Saves the JSON object to disk.
      */
@@ -103,6 +103,36 @@ fileSave(DataSlice data, const std::string &path)
     return Status();
 }
 
+Status
+fileAppend(DataSlice data, const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "ab");
+    if (!fp)
+        return ABC_ERROR(ABC_CC_FileOpenError,
+                         "Cannot open " + path + " for appending");
+
+    if (1 != fwrite(data.data(), data.size(), 1, fp))
+    {
+        fclose(fp);
+        return ABC_ERROR(ABC_CC_FileWriteError, "Cannot append to " + path);
+    }
+    if (fclose(fp))
+        return ABC_ERROR(ABC_CC_FileWriteError, "Cannot append to " + path);
+
+    return Status();
+}
+
+Status
+fileAppendOrSave(bool &ok, DataSlice data, const std::string &path)
+{
+    const bool append = ok;
+    ok = false;
+    ABC_CHECK(append ? fileAppend(data, path) : fileSave(data, path));
+    ok = true;
+
+    return Status();
+}
+
 static Status
 fileDeleteRecursive(const std::string &path)
 {
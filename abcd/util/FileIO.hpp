@@ -54,6 +54,21 @@ fileLoad(DataChunk &result, const std::string &path);
 Status
 fileSave(DataSlice data, const std::string &path);
 
+/**
+ * Appends data to the end of a file, creating it if necessary.
+ */
+Status
+fileAppend(DataSlice data, const std::string &path);
+
+/**
+ * Appends data to a file if `ok` is true, or replaces the file otherwise.
+ * Leaves `ok` false if the write fails,
+ * since a failed append could leave a torn record behind,
+ * and the next write needs to start the file over.
+ */
+Status
+fileAppendOrSave(bool &ok, DataSlice data, const std::string &path);
+
 /**
  * Deletes a file recursively.
  */
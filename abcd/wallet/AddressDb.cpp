@@ -18,6 +18,9 @@
 
 namespace abcd {
 
+// Unused addresses to keep ready past the last used one:
+constexpr size_t stockpileSize = 5;
+
 struct AddressMetaJson:
     public JsonObject
 {
@@ -283,6 +286,28 @@ AddressDb::recycleSet(const std::string &address, bool recycle)
 Status
 AddressDb::markOutputs(const TxInfo &info)
 {
+    // Claim any lookahead addresses the transaction touches:
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        bool claimed = false;
+        for (const auto &io: info.ios)
+        {
+            for (auto i = lookahead_.begin(); i != lookahead_.end(); ++i)
+            {
+                if (i->second != io.address)
+                    continue;
+
+                ABC_CHECK(lookaheadClaim(i->first, i->second));
+                lookahead_.erase(i);
+                claimed = true;
+                break;
+            }
+        }
+        if (claimed)
+            ABC_CHECK(stockpile());
+    }
+
     for (const auto &io: info.ios)
     {
         if (!io.input)
@@ -304,7 +329,8 @@ AddressDb::stockpile()
 
     // Check for gaps:
     size_t lastUsed = 0;
-    for (size_t i = 0; i < addresses_.size() || i < lastUsed + 5; ++i)
+    size_t i = 0;
+    for (; i < addresses_.size() || i < lastUsed + stockpileSize; ++i)
     {
         auto index = indices.find(i);
         if (index == indices.end())
@@ -318,14 +344,7 @@ AddressDb::stockpile()
                 address.address = m00n.address().encoded();
                 address.recyclable = true;
                 address.time = time(nullptr);
-                addresses_[address.address] = address;
-
-                AddressJson json;
-                ABC_CHECK(json.pack(address));
-                ABC_CHECK(json.save(path(address), wallet_.dataKey()));
-                files_[address.address] = json;
-
-                wallet_.cache.addresses.insert(address.address);
+                ABC_CHECK(insert(address));
             }
         }
         else if (!index->second)
@@ -333,10 +352,87 @@ AddressDb::stockpile()
             lastUsed = i;
         }
     }
+    lookahead_.erase(lookahead_.begin(), lookahead_.lower_bound(i));
+
+    // Watch the addresses past the stockpile without saving them:
+    for (; i < lastUsed + lookaheadGap_; ++i)
+    {
+        if (lookahead_.count(i))
+            continue;
+
+        auto m00n = mainBranch(wallet_).generate_private_key(i);
+        if (m00n.valid())
+        {
+            lookahead_[i] = m00n.address().encoded();
+            wallet_.cache.addresses.insertLookahead(lookahead_[i]);
+        }
+    }
+
+    return Status();
+}
+
+Status
+AddressDb::insert(const AddressMeta &address)
+{
+    addresses_[address.address] = address;
+
+    AddressJson json;
+    ABC_CHECK(json.pack(address));
+    ABC_CHECK(json.save(path(address), wallet_.dataKey()));
+    files_[address.address] = json;
+
+    wallet_.cache.addresses.insert(address.address);
+    return Status();
+}
+
+Status
+AddressDb::discoveryStart(size_t gap)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    lookaheadGap_ = gap;
+    ABC_CHECK(stockpile());
+    return Status();
+}
+
+Status
+AddressDb::discoveryStop()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    lookaheadGap_ = 0;
+
+    // The cache keeps any address that has seen a transaction,
+    // even if the transaction never made it to `markOutputs`,
+    // so claim those instead of leaving them in limbo:
+    bool claimed = false;
+    auto i = lookahead_.begin();
+    while (i != lookahead_.end())
+    {
+        if (!wallet_.cache.addresses.remove(i->second))
+        {
+            ABC_CHECK(lookaheadClaim(i->first, i->second));
+            claimed = true;
+        }
+        i = lookahead_.erase(i);
+    }
+    if (claimed)
+        ABC_CHECK(stockpile());
 
     return Status();
 }
 
+Status
+AddressDb::lookaheadClaim(size_t index, const std::string &address)
+{
+    AddressMeta meta;
+    meta.index = index;
+    meta.address = address;
+    meta.recyclable = false;
+    meta.time = time(nullptr);
+    ABC_CHECK(insert(meta));
+    return Status();
+}
+
 std::string
 AddressDb::path(const AddressMeta &address)
 {
@@ -19,6 +19,10 @@ namespace abcd {
 
 class Wallet;
 struct TxInfo;
+
+// How far past the last used address a restored wallet looks for funds:
+constexpr size_t discoveryGap = 50;
+
 typedef std::map<const std::string, std::string> KeyTable;
 
 struct AddressMeta
@@ -99,6 +103,22 @@ public:
     Status
     markOutputs(const TxInfo &info);
 
+    /**
+     * Watches the addresses past the end of the stockpile,
+     * up to `gap` addresses beyond the last used one,
+     * so a restored wallet can find all its funds in one pass.
+     * Addresses only go into the sync directory once they see a transaction.
+     */
+    Status
+    discoveryStart(size_t gap=discoveryGap);
+
+    /**
+     * Stops watching any lookahead addresses that never saw a transaction.
+     * The ones that did see a transaction become normal saved addresses.
+     */
+    Status
+    discoveryStop();
+
 private:
     mutable std::mutex mutex_;
     Wallet &wallet_;
@@ -107,6 +127,10 @@ private:
     std::map<std::string, AddressMeta> addresses_;
     std::map<std::string, JsonPtr> files_;
 
+    // Watched addresses past the end of the stockpile, by index:
+    std::map<size_t, std::string> lookahead_;
+    size_t lookaheadGap_ = 0;
+
     /**
      * Ensures that there are no gaps in the address list,
      * and at there are several extra addresses ready to go.
@@ -114,6 +138,19 @@ private:
     Status
     stockpile();
 
+    /**
+     * Adds a new address to the database, the sync directory, and the cache.
+     */
+    Status
+    insert(const AddressMeta &address);
+
+    /**
+     * Turns a lookahead address into a normal, used address.
+     * The caller removes it from `lookahead_`.
+     */
+    Status
+    lookaheadClaim(size_t index, const std::string &address);
+
     std::string
     path(const AddressMeta &address);
 };
@@ -94,9 +94,15 @@ Wallet::create(std::shared_ptr<Wallet> &result, Account &account,
     ABC_CHECK(out->loadSync());
 
     // Load the transaction cache (failure is fine):
-    if (!out->cache.load().log())
+    if (!out->cache.load().log() &&
+            !out->cache.loadJson(out->paths.cachePathJson()).log())
         out->cache.loadLegacy(out->paths.cachePathOld());
 
+    // Look for funds the sync directory doesn't know about yet,
+    // unless this device has already checked the whole wallet:
+    if (!out->cache.addressCheckDoneGet())
+        ABC_CHECK(out->addresses.discoveryStart());
+
     result = std::move(out);
 
     overrideServers(account, result);
@@ -113,7 +119,8 @@ Wallet::createNew(std::shared_ptr<Wallet> &result, Account &account,
     ABC_CHECK(out->createNew(name, currency));
 
     // Load the transaction cache (failure is fine):
-    if (!out->cache.load().log())
+    if (!out->cache.load().log() &&
+            !out->cache.loadJson(out->paths.cachePathJson()).log())
         out->cache.loadLegacy(out->paths.cachePathOld());
 
     result = std::move(out);
@@ -192,7 +199,7 @@ Wallet::balance(int64_t &result)
     std::lock_guard<std::mutex> lock(mutex_);
     if (dirty)
     {
-        const auto utxos = cache.txs.utxos(addresses.list());
+        const auto utxos = cache.txs.snapshot()->utxos(addresses.list());
 
         balance_ = 0;
         for (const auto &utxo: utxos)
@@ -231,7 +238,7 @@ Wallet::Wallet(Account &account, const std::string &id):
     addresses(*this),
     txs(*this),
     cache(*new Cache(paths.cachePath(), gContext->blockCache,
-                     gContext->serverCache))
+                     gContext->txStore, gContext->serverCache))
 {}
 
 Status
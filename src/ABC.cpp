@@ -2117,10 +2117,11 @@ tABC_CC ABC_GetTransaction(const char *szUserName,
     {
         ABC_GET_WALLET();
 
+        const auto snapshot = wallet->cache.txs.snapshot();
         TxInfo info;
         TxStatus status;
-        ABC_CHECK_NEW(wallet->cache.txs.info(info, szID));
-        ABC_CHECK_NEW(wallet->cache.txs.status(status, szID));
+        ABC_CHECK_NEW(snapshot->info(info, szID));
+        ABC_CHECK_NEW(snapshot->status(status, szID));
         *ppTransaction = makeTxInfo(*wallet, info, status);
     }
 
@@ -2243,7 +2244,7 @@ tABC_CC ABC_SetTransactionDetails(const char *szUserName,
         ABC_GET_WALLET();
 
         TxInfo info;
-        ABC_CHECK_NEW(wallet->cache.txs.info(info, szID));
+        ABC_CHECK_NEW(wallet->cache.txs.snapshot()->info(info, szID));
         auto balance = wallet->addresses.balance(info);
 
         TxMeta meta;
@@ -2283,7 +2284,7 @@ tABC_CC ABC_GetTransactionDetails(const char *szUserName,
         ABC_GET_WALLET();
 
         TxInfo info;
-        ABC_CHECK_NEW(wallet->cache.txs.info(info, szID));
+        ABC_CHECK_NEW(wallet->cache.txs.snapshot()->info(info, szID));
 
         TxMeta meta;
         ABC_CHECK_NEW(wallet->txs.get(meta, info.ntxid));
@@ -3024,7 +3025,7 @@ tABC_CC ABC_TxHeight(const char *szWalletUUID, const char *szTxid,
         ABC_GET_WALLET_N();
 
         TxStatus status;
-        ABC_CHECK_NEW(wallet->cache.txs.status(status, szTxid));
+        ABC_CHECK_NEW(wallet->cache.txs.snapshot()->status(status, szTxid));
         *height = status.height;
     }
 
@@ -130,7 +130,8 @@ tABC_CC ABC_TxGetTransactions(Wallet &self,
     tABC_TxInfo **aTransactions = NULL;
     unsigned int count = 0;
 
-    const auto infos = self.cache.txs.statuses(self.cache.addresses.txids());
+    const auto infos = self.cache.txs.snapshot()->statuses(
+                         self.cache.addresses.txids());
 
     std::map<std::string, TxMeta> txsMap = self.txs.getTxs();
     std::map<std::string, TxMeta>::iterator it;
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2016, Airbitz, Inc.
+ * All rights reserved.
+ *
+ * See the LICENSE file for more information.
+ */
+
+#include "../abcd/bitcoin/cache/AddressCache.hpp"
+#include "../abcd/bitcoin/cache/BlockCache.hpp"
+#include "../abcd/bitcoin/cache/TxCache.hpp"
+#include "../abcd/bitcoin/cache/TxStore.hpp"
+#include "../minilibs/catch/catch.hpp"
+
+/**
+ * Checks that the next scheduled check is `period` seconds away,
+ * allowing for the clock to tick between calls.
+ */
+static bool
+checkPeriod(const abcd::AddressCache &addressCache, time_t period)
+{
+    time_t sleep;
+    addressCache.statuses(sleep);
+    return period - 1 <= sleep && sleep <= period;
+}
+
+TEST_CASE("Address polling", "[bitcoin][database]")
+{
+    abcd::BlockCache blockCache("", "");
+    abcd::TxStore txStore("");
+    abcd::TxCache txCache(blockCache, txStore);
+    abcd::AddressCache addressCache(txCache);
+
+    const std::string address = "1BitcoinEaterAddressDontSendf59kuE";
+    addressCache.insert(address);
+    addressCache.update(address, abcd::TxidSet());
+    REQUIRE(checkPeriod(addressCache, 20));
+
+    SECTION("quiet addresses back off")
+    {
+        addressCache.updateSubscribe(address);
+        REQUIRE(checkPeriod(addressCache, 40));
+        addressCache.updateSubscribe(address);
+        REQUIRE(checkPeriod(addressCache, 80));
+    }
+
+    SECTION("activity resets the backoff")
+    {
+        addressCache.updateSubscribe(address);
+        addressCache.updateSubscribe(address);
+        addressCache.updateStratumHash(address, "00ff");
+        REQUIRE(checkPeriod(addressCache, 20));
+    }
+
+    SECTION("priority addresses")
+    {
+        addressCache.updateSubscribe(address);
+        addressCache.prioritize(address);
+        REQUIRE(checkPeriod(addressCache, 4));
+        addressCache.prioritize("");
+        REQUIRE(checkPeriod(addressCache, 20));
+    }
+
+    SECTION("priority checks do not back off")
+    {
+        addressCache.prioritize(address);
+        for (int i = 0; i < 8; ++i)
+            addressCache.updateSubscribe(address);
+        REQUIRE(checkPeriod(addressCache, 4));
+        addressCache.prioritize("");
+        REQUIRE(checkPeriod(addressCache, 20));
+        addressCache.updateSubscribe(address);
+        REQUIRE(checkPeriod(addressCache, 40));
+    }
+}
+
+TEST_CASE("Lookahead addresses", "[bitcoin][database]")
+{
+    abcd::BlockCache blockCache("", "");
+    abcd::TxStore txStore("");
+    abcd::TxCache txCache(blockCache, txStore);
+    abcd::AddressCache addressCache(txCache);
+
+    const std::string address = "1BitcoinEaterAddressDontSendf59kuE";
+    addressCache.insertLookahead(address);
+    REQUIRE(1 == addressCache.progress().second);
+
+    SECTION("unclaimed addresses can be removed")
+    {
+        REQUIRE(addressCache.remove(address));
+        REQUIRE(0 == addressCache.progress().second);
+    }
+
+    SECTION("late replies do not bring addresses back")
+    {
+        addressCache.remove(address);
+        addressCache.update(address, abcd::TxidSet());
+        addressCache.updateSubscribe(address);
+        REQUIRE(0 == addressCache.progress().second);
+    }
+
+    SECTION("claimed addresses stay")
+    {
+        addressCache.insert(address);
+        REQUIRE(!addressCache.remove(address));
+        REQUIRE(1 == addressCache.progress().second);
+    }
+
+    SECTION("used addresses stay")
+    {
+        addressCache.update(address, abcd::TxidSet{"00ff"});
+        REQUIRE(!addressCache.remove(address));
+        REQUIRE(1 == addressCache.progress().second);
+    }
+}
+
+TEST_CASE("Clean replies complete loaded addresses", "[bitcoin][database]")
+{
+    abcd::BlockCache blockCache("", "");
+    abcd::TxStore txStore("");
+    abcd::TxCache txCache(blockCache, txStore);
+    abcd::AddressCache addressCache(txCache);
+
+    std::set<std::string> completed;
+    addressCache.onCompleteSet([&completed](const std::string &address)
+    {
+        completed.insert(address);
+    });
+
+    // One clean, empty row that is due for a check:
+    const std::string address = "1BitcoinEaterAddressDontSendf59kuE";
+    bc::data_chunk data;
+    abcd::CacheWriter writer(std::back_inserter(data));
+    writer.write_variable_uint(1);
+    writer.write_string(address);
+    writer.write_variable_uint(0); // txids
+    writer.write_byte(false); // dirty
+    writer.write_8_bytes(0); // lastCheck
+    writer.write_string("00ff"); // stratumHash
+
+    abcd::CacheReader reader(data.data(), data.data() + data.size());
+    REQUIRE(addressCache.load(reader));
+    REQUIRE(completed.empty());
+
+    REQUIRE(!addressCache.updateStratumHash(address, "00ff"));
+    REQUIRE(completed.count(address));
+    REQUIRE(1 == addressCache.progress().first);
+}
+
+/**
+ * Returns true if the address is marked dirty.
+ */
+static bool
+isDirty(const abcd::AddressCache &addressCache, const std::string &address)
+{
+    time_t sleep;
+    for (const auto &status: addressCache.statuses(sleep))
+        if (address == status.address)
+            return status.dirty;
+    return false;
+}
+
+TEST_CASE("Local status hashes", "[bitcoin][database]")
+{
+    abcd::BlockCache blockCache("", "");
+    abcd::TxStore txStore("");
+    abcd::TxCache txCache(blockCache, txStore);
+    abcd::AddressCache addressCache(txCache);
+
+    // The heights are out of txid order, and one is in the mempool:
+    const std::string first(64, 'b');
+    const std::string second(64, 'a');
+    const std::string mempool(64, '0');
+    txCache.confirmed(first, 100);
+    txCache.confirmed(second, 200);
+    txCache.confirmed(mempool, 0);
+
+    // One clean row, checked just now:
+    const std::string address = "1BitcoinEaterAddressDontSendf59kuE";
+    bc::data_chunk data;
+    abcd::CacheWriter writer(std::back_inserter(data));
+    writer.write_variable_uint(1);
+    writer.write_string(address);
+    writer.write_variable_uint(3);
+    for (const auto &txid: {first, second, mempool})
+    {
+        bc::hash_digest hash;
+        REQUIRE(bc::decode_hash(hash, txid));
+        writer.write_hash(hash);
+    }
+    writer.write_byte(false); // dirty
+    writer.write_8_bytes(time(nullptr)); // lastCheck
+    writer.write_string("00ff"); // stratumHash
+
+    abcd::CacheReader reader(data.data(), data.data() + data.size());
+    REQUIRE(addressCache.load(reader));
+    REQUIRE(!isDirty(addressCache, address));
+
+    // sha256 of "bb..bb:100:aa..aa:200:00..00:0:":
+    const std::string status =
+        "059667fbacbcacfaec3bc5908abdf9d28d8e668c61798fd1bd29fd94f7b9fd05";
+
+    SECTION("a matching status needs no history")
+    {
+        REQUIRE(!addressCache.updateStratumHash(address, status));
+        REQUIRE(!isDirty(addressCache, address));
+        REQUIRE(status == addressCache.getStratumHash(address));
+    }
+
+    SECTION("a different status still needs history")
+    {
+        REQUIRE(addressCache.updateStratumHash(address, "00fe"));
+        REQUIRE(isDirty(addressCache, address));
+    }
+}
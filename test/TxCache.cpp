@@ -9,7 +9,10 @@
 #include "../abcd/bitcoin/cache/TxCache.hpp"
 #include "../abcd/bitcoin/Utility.hpp"
 #include "../abcd/bitcoin/spend/Outputs.hpp"
+#include "../abcd/util/FileIO.hpp"
 #include "../minilibs/catch/catch.hpp"
+#include <stdlib.h>
+#include <unistd.h>
 
 namespace abcd {
 
@@ -126,6 +129,7 @@ public:
         };
         doubleSpendId = bc::hash_transaction(doubleSpend);
         txCache.insert(doubleSpend);
+        txCache.confirmed(bc::encode_hash(doubleSpendId), 0, 1); // Long ago
 
         // Spend from buried[1], two outputs:
         bc::transaction_type change
@@ -161,6 +165,34 @@ public:
 
 } // namespace abcd
 
+/**
+ * A scratch file in its own temporary directory,
+ * which goes away when the test ends, whether it passes or not.
+ */
+struct TempFile
+{
+    std::string dir;
+    std::string path;
+
+    TempFile(const std::string &name)
+    {
+        char buffer[] = "/tmp/abc-test-XXXXXX";
+        if (mkdtemp(buffer))
+        {
+            dir = buffer;
+            path = dir + "/" + name;
+        }
+    }
+
+    ~TempFile()
+    {
+        if (dir.empty())
+            return;
+        unlink(path.c_str());
+        rmdir(dir.c_str());
+    }
+};
+
 static void
 dumpUtxos(const bc::output_info_list &utxos)
 {
@@ -183,8 +215,9 @@ hasTxid(const bc::output_info_list &utxos, bc::hash_digest txid, uint32_t index)
 
 TEST_CASE("Transaction database", "[bitcoin][database]")
 {
-    abcd::BlockCache blockCache("");
-    abcd::TxCache txCache(blockCache);
+    abcd::BlockCache blockCache("", "");
+    abcd::TxStore txStore("");
+    abcd::TxCache txCache(blockCache, txStore);
     abcd::TxCacheTest test(txCache);
     const auto rawUtxos = txCache.utxos(test.ourAddresses);
 
@@ -208,4 +241,270 @@ TEST_CASE("Transaction database", "[bitcoin][database]")
         REQUIRE(hasTxid(utxos, test.changeId, 1));
         REQUIRE(!hasTxid(utxos, test.badSpendId, 0));
     }
+
+    SECTION("sorted utxos")
+    {
+        const auto utxos = filterOutputs(rawUtxos, false);
+        for (size_t i = 1; i < utxos.size(); ++i)
+        {
+            const auto &a = utxos[i - 1].point;
+            const auto &b = utxos[i].point;
+            REQUIRE((a.hash < b.hash ||
+                     (a.hash == b.hash && a.index < b.index)));
+        }
+    }
+
+    SECTION("updates after a drop")
+    {
+        // Dropping the double-spend clears the problem on its descendants:
+        REQUIRE(txCache.drop(bc::encode_hash(test.doubleSpendId)));
+        const auto utxos = filterOutputs(txCache.utxos(test.ourAddresses), true);
+        REQUIRE(3 == utxos.size());
+        REQUIRE(hasTxid(utxos, test.confirmedId, 0));
+        REQUIRE(hasTxid(utxos, test.changeId, 1));
+        REQUIRE(hasTxid(utxos, test.badSpendId, 0));
+    }
+
+    SECTION("other addresses")
+    {
+        // The index should only return outputs for the requested address:
+        const auto utxos = txCache.utxos({"1QLbz7JHiBTspS962RLKV8GndWFwi5j6Qr"});
+        REQUIRE(1 == utxos.size());
+        REQUIRE(test.irrelevantId == utxos.front().point.hash);
+        REQUIRE(!utxos.front().isSpendable); // replace-by-fee
+    }
+
+    SECTION("binary round trip")
+    {
+        bc::data_chunk data;
+        abcd::CacheWriter writer(std::back_inserter(data));
+        txCache.save(writer);
+
+        abcd::TxCache loaded(blockCache, txStore);
+        abcd::CacheReader reader(data.data(), data.data() + data.size());
+        REQUIRE(loaded.load(reader));
+
+        const auto utxos = filterOutputs(loaded.utxos(test.ourAddresses), true);
+        REQUIRE(2 == utxos.size());
+        REQUIRE(hasTxid(utxos, test.confirmedId, 0));
+        REQUIRE(hasTxid(utxos, test.changeId, 1));
+
+        abcd::TxStatus status;
+        REQUIRE(loaded.status(status, bc::encode_hash(test.confirmedId)));
+        REQUIRE(100 == status.height);
+    }
+
+    SECTION("store keys by hash")
+    {
+        abcd::TxStore store("");
+        const auto tx = store.insert(*txStore.get(test.confirmedId));
+        REQUIRE(tx == store.get(test.confirmedId));
+        REQUIRE(!store.get(test.incomingId));
+    }
+
+    SECTION("store round trip")
+    {
+        const TempFile temp("Transactions.bin");
+        REQUIRE(!temp.path.empty());
+        const auto &path = temp.path;
+        {
+            abcd::TxStore store(path);
+            store.insert(*txStore.get(test.confirmedId));
+            REQUIRE(store.save());
+            store.insert(*txStore.get(test.incomingId));
+            REQUIRE(store.save()); // Appends
+            store.insert(*txStore.get(test.confirmedId));
+            REQUIRE(store.save()); // Already on disk
+        }
+
+        abcd::TxStore loaded(path);
+        const auto confirmed = loaded.get(test.confirmedId);
+        const auto incoming = loaded.get(test.incomingId);
+        REQUIRE(confirmed);
+        REQUIRE(incoming);
+        REQUIRE(!loaded.get(test.changeId));
+
+        // Each transaction is on disk once:
+        abcd::DataChunk file;
+        REQUIRE(abcd::fileLoad(file, path));
+        const size_t size = 4 + 2 * (8 + 32) +
+                            satoshi_raw_size(*confirmed) +
+                            satoshi_raw_size(*incoming);
+        REQUIRE(size == file.size());
+    }
+
+    SECTION("store sweep")
+    {
+        const TempFile temp("Transactions.bin");
+        REQUIRE(!temp.path.empty());
+        const auto &path = temp.path;
+        {
+            abcd::TxStore store(path);
+            store.insert(*txStore.get(test.confirmedId));
+            store.insert(*txStore.get(test.incomingId));
+            store.insert(*txStore.get(test.changeId));
+            REQUIRE(store.save());
+        }
+
+        // A wallet on disk uses one transaction, and one is in memory:
+        abcd::TxStore swept(path, [&](abcd::TxStore::Txids &result)
+        {
+            result.insert(test.confirmedId);
+            return abcd::Status();
+        });
+        const auto held = swept.get(test.changeId);
+        REQUIRE(held);
+        REQUIRE(swept.save());
+        REQUIRE(swept.get(test.confirmedId));
+        REQUIRE(swept.get(test.changeId));
+        REQUIRE(!swept.get(test.incomingId));
+    }
+
+    SECTION("journal replay")
+    {
+        bc::data_chunk snapshot;
+        abcd::CacheWriter snapshotWriter(std::back_inserter(snapshot));
+        txCache.save(snapshotWriter);
+
+        // Changes after the snapshot go in the journal:
+        REQUIRE(txCache.drop(bc::encode_hash(test.doubleSpendId)));
+        bc::data_chunk journal;
+        abcd::CacheWriter journalWriter(std::back_inserter(journal));
+        REQUIRE(txCache.journalSave(journalWriter));
+
+        abcd::TxCache loaded(blockCache, txStore);
+        abcd::CacheReader snapshotReader(snapshot.data(),
+                                         snapshot.data() + snapshot.size());
+        REQUIRE(loaded.load(snapshotReader));
+        abcd::CacheReader journalReader(journal.data(),
+                                        journal.data() + journal.size());
+        REQUIRE(loaded.journalLoad(journalReader));
+
+        const auto utxos = filterOutputs(loaded.utxos(test.ourAddresses), true);
+        REQUIRE(3 == utxos.size());
+        REQUIRE(hasTxid(utxos, test.badSpendId, 0));
+    }
+
+    SECTION("info follows its inputs")
+    {
+        const auto badSpendId = bc::encode_hash(test.badSpendId);
+        abcd::TxInfo info;
+        REQUIRE(txCache.info(info, badSpendId));
+
+        // Losing an input makes the info unavailable:
+        bc::transaction_type doubleSpend;
+        REQUIRE(txCache.get(doubleSpend, bc::encode_hash(test.doubleSpendId)));
+        REQUIRE(txCache.drop(bc::encode_hash(test.doubleSpendId)));
+        REQUIRE(!txCache.info(info, badSpendId));
+
+        // Getting it back restores things:
+        txCache.insert(doubleSpend);
+        REQUIRE(txCache.info(info, badSpendId));
+        REQUIRE(badSpendId == info.txid);
+        REQUIRE(3 == info.ios.size());
+    }
+
+    SECTION("snapshots stay put")
+    {
+        const auto badSpendId = bc::encode_hash(test.badSpendId);
+        txCache.snapshotPublish();
+        const auto before = txCache.snapshot();
+        abcd::TxStatus status;
+        REQUIRE(before->status(status, badSpendId));
+        REQUIRE(status.isDoubleSpent);
+
+        // Changes only show up once they are published:
+        REQUIRE(txCache.drop(bc::encode_hash(test.doubleSpendId)));
+        REQUIRE(before == txCache.snapshot());
+        txCache.snapshotPublish();
+        const auto after = txCache.snapshot();
+        REQUIRE(before->status(status, badSpendId));
+        REQUIRE(status.isDoubleSpent);
+        REQUIRE(after->status(status, badSpendId));
+        REQUIRE(!status.isDoubleSpent);
+
+        abcd::TxInfo info;
+        REQUIRE(before->info(info, bc::encode_hash(test.doubleSpendId)));
+        REQUIRE(!after->info(info, bc::encode_hash(test.doubleSpendId)));
+        txCache.snapshotPublish();
+        REQUIRE(after == txCache.snapshot());
+    }
+
+    SECTION("snapshot utxos")
+    {
+        txCache.snapshotPublish();
+        const auto before = txCache.snapshot();
+        REQUIRE(3 == filterOutputs(before->utxos(test.ourAddresses)).size());
+        REQUIRE(2 == filterOutputs(before->utxos(test.ourAddresses),
+                                   true).size());
+
+        // The snapshot matches the live cache after a change:
+        REQUIRE(txCache.drop(bc::encode_hash(test.doubleSpendId)));
+        txCache.snapshotPublish();
+        const auto utxos = filterOutputs(
+                               txCache.snapshot()->utxos(test.ourAddresses), true);
+        REQUIRE(3 == utxos.size());
+        REQUIRE(hasTxid(utxos, test.badSpendId, 0));
+        REQUIRE(2 == filterOutputs(before->utxos(test.ourAddresses),
+                                   true).size());
+    }
+
+    SECTION("shared store")
+    {
+        // Another wallet can pick up transactions without fetching them:
+        abcd::TxCache other(blockCache, txStore);
+        const auto confirmedId = bc::encode_hash(test.confirmedId);
+        REQUIRE(other.missing(confirmedId));
+        REQUIRE(other.insertStored(confirmedId));
+        REQUIRE(!other.insertStored(bc::encode_hash(bc::null_hash)));
+
+        bc::transaction_type tx;
+        REQUIRE(other.get(tx, confirmedId));
+
+        // Dropping a transaction leaves it in the store for the others:
+        const auto doubleSpendId = bc::encode_hash(test.doubleSpendId);
+        REQUIRE(txCache.drop(doubleSpendId));
+        REQUIRE(other.insertStored(doubleSpendId));
+        REQUIRE(!other.drop(bc::encode_hash(bc::null_hash)));
+        REQUIRE(other.heights({bc::encode_hash(bc::null_hash)}).empty());
+    }
+
+    SECTION("mismatched txids")
+    {
+        // A transaction only goes in under its own hash:
+        bc::transaction_type tx;
+        REQUIRE(txCache.get(tx, bc::encode_hash(test.confirmedId)));
+        tx.locktime = 1;
+        const auto txid = bc::encode_hash(test.incomingId);
+        abcd::TxCache other(blockCache, txStore);
+        REQUIRE(!other.insert(tx, txid));
+        REQUIRE(other.missing(txid));
+        REQUIRE(other.insert(tx, bc::encode_hash(bc::hash_transaction(tx))));
+    }
+
+    SECTION("heights")
+    {
+        const auto confirmedId = bc::encode_hash(test.confirmedId);
+        const auto unknownId = bc::encode_hash(bc::null_hash);
+        const auto heights = txCache.heights({confirmedId, unknownId});
+        REQUIRE(1 == heights.size());
+        REQUIRE(100 == heights.at(confirmedId));
+    }
+
+    SECTION("unconfirmed index")
+    {
+        const auto incomingId = bc::encode_hash(test.incomingId);
+        REQUIRE(5 == txCache.unconfirmed().size());
+        REQUIRE(txCache.unconfirmed().count(incomingId));
+        REQUIRE(!txCache.unconfirmed().count(bc::encode_hash(test.confirmedId)));
+
+        txCache.confirmed(incomingId, 101);
+        REQUIRE(!txCache.unconfirmed().count(incomingId));
+
+        txCache.confirmed(incomingId, 0);
+        REQUIRE(txCache.unconfirmed().count(incomingId));
+
+        txCache.clear();
+        REQUIRE(txCache.unconfirmed().empty());
+    }
 }